@@ -0,0 +1,82 @@
+// Pre-rasterizes the default GeistMono atlas into a header so led can upload it
+// straight to a texture at startup instead of parsing the TTF.
+//
+// usage: bake_atlas <font size> <glyph padding> <output header>
+//
+// The header is committed, so building led doesn't need this. After changing
+// the font, FONT_GLYPH_PADDING or the default size, regenerate it by hand:
+//
+//   gcc fonts/bake_atlas.c -Llib/ -lraylib -lGL -lm -lpthread -ldl -Iinclude/ -o bake_atlas
+//   ./bake_atlas 24 4 fonts/GeistMono-Atlas.h
+
+#include "raylib.h"
+
+#include "GeistMono-Regular.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define GLYPHS_NUM 95
+
+void write_bytes(FILE *f, const unsigned char *bytes, int len)
+{
+    for (int i = 0; i < len; ++i) {
+        if (i%12 == 0)
+            fprintf(f, "  ");
+        fprintf(f, "0x%02x%s", bytes[i], i == len - 1? "\n" : (i%12 == 11? ",\n" : ", "));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4) {
+        printf("usage: bake_atlas <font size> <glyph padding> <output header>\n");
+        return 1;
+    }
+
+    int size = atoi(argv[1]);
+    int padding = atoi(argv[2]);
+
+    SetTraceLogLevel(LOG_NONE);
+    GlyphInfo *glyphs = LoadFontData(GeistMono_Regular_ttf, GeistMono_Regular_ttf_len, size, NULL, GLYPHS_NUM, FONT_DEFAULT);
+    Rectangle *recs = NULL;
+    Image atlas = GenImageFontAtlas(glyphs, &recs, GLYPHS_NUM, size, padding, 0);
+    int atlas_len = GetPixelDataSize(atlas.width, atlas.height, atlas.format);
+
+    FILE *f = fopen(argv[3], "w");
+    if (!f) {
+        printf("bake_atlas: could not open %s\n", argv[3]);
+        return 1;
+    }
+
+    fprintf(f, "// Generated by fonts/bake_atlas.c, do not edit\n");
+    fprintf(f, "#define GeistMono_Regular_atlas_size    %d\n", size);
+    fprintf(f, "#define GeistMono_Regular_atlas_padding %d\n", padding);
+    fprintf(f, "#define GeistMono_Regular_atlas_width   %d\n", atlas.width);
+    fprintf(f, "#define GeistMono_Regular_atlas_height  %d\n", atlas.height);
+    fprintf(f, "#define GeistMono_Regular_atlas_format  %d\n", atlas.format);
+    fprintf(f, "#define GeistMono_Regular_atlas_glyphs  %d\n\n", GLYPHS_NUM);
+
+    fprintf(f, "// { value, offsetX, offsetY, advanceX }\n");
+    fprintf(f, "int GeistMono_Regular_atlas_metrics[][4] = {\n");
+    for (int i = 0; i < GLYPHS_NUM; ++i)
+        fprintf(f, "  { %d, %d, %d, %d },\n", glyphs[i].value, glyphs[i].offsetX, glyphs[i].offsetY, glyphs[i].advanceX);
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "// { x, y, width, height }\n");
+    fprintf(f, "float GeistMono_Regular_atlas_recs[][4] = {\n");
+    for (int i = 0; i < GLYPHS_NUM; ++i)
+        fprintf(f, "  { %.1ff, %.1ff, %.1ff, %.1ff },\n", recs[i].x, recs[i].y, recs[i].width, recs[i].height);
+    fprintf(f, "};\n\n");
+
+    fprintf(f, "unsigned char GeistMono_Regular_atlas[] = {\n");
+    write_bytes(f, atlas.data, atlas_len);
+    fprintf(f, "};\n");
+    fprintf(f, "unsigned int GeistMono_Regular_atlas_len = %d;\n", atlas_len);
+
+    fclose(f);
+    UnloadImage(atlas);
+    MemFree(recs);
+    UnloadFontData(glyphs, GLYPHS_NUM);
+    return 0;
+}
@@ -1,49 +1,504 @@
+#define _GNU_SOURCE
 #include "raylib.h"
 
 #include "theme.h"
 #include "fonts/GeistMono-Regular.h"
+#include "fonts/GeistMono-Atlas.h"
 
 #include <stdio.h>
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+    #include <immintrin.h>
+    #define SCAN_X86 1
+#else
+    #define SCAN_X86 0
+#endif
 
 #define WINDOW_WIDTH    800
 #define WINDOW_HEIGHT   600
 #define FPS             60
 
-#define LINE_SIZE       1024
+#define ADD_BUFFER_INIT  4096
+#define LINE_BUFFER_INIT 1024
+
+#define OP_LOG_INIT 4096
+
+#define UNDO_SIDECAR_MAGIC     "LEDUNDO1"
+#define UNDO_SNAPSHOT_INTERVAL 256
+#define UNDO_TIME_STEP         60.0
+
+#define PIECE_NODE_MAX 32
+#define PIECE_NODE_MIN (PIECE_NODE_MAX/4)
+
+#define MAX_WORKERS     64
+#define SCAN_CHUNK_SIZE (16*1024*1024)
+#define LOAD_FIRST_SIZE (1024*1024)
+
+#define FIND_QUERY_MAX 256
+#define FIND_NONE      UINT64_MAX
+
+// Trigrams hash to one of TRIGRAM_BITS bits in the signature of each block
+#define TRIGRAM_BLOCK_SIZE (32*1024)
+#define TRIGRAM_HASH_BITS  12
+#define TRIGRAM_BITS       (1 << TRIGRAM_HASH_BITS)
+#define TRIGRAM_WORDS      (TRIGRAM_BITS/64)
+#define TRIGRAM_GROUP      64
 
-#define REPEAT_COOLDOWN 3
+#define SEARCH_REGEX_FLAGS (REG_EXTENDED | REG_NEWLINE)
+#define SEARCH_CHUNK_SIZE  (1024*1024)
+#define SEARCH_LINE_READ   4096
+#define SEARCH_MATCH_MAX   100000
+#define SEARCH_LIST_LINES  8
+#define SEARCH_PREVIEW_MAX 120
+
+// Held keys repeat after REPEAT_DELAY seconds, REPEAT_RATE times a second
+#define REPEAT_DELAY 0.4
+#define REPEAT_RATE  30.0
+
+// How far a save goes before it counts as done; LED_SYNC=none|file|dir overrides it
+#ifndef SAVE_SYNC
+#define SAVE_SYNC SAVE_SYNC_DIRECTORY
+#endif
+#define SAVE_IOV_MAX    1024
+#define SAVE_SPLICE_MIN (64*1024)
 
 #define FONT_SIZE_INIT     24
 #define FONT_RESIZE_FACTOR 4
 #define FONT_RESIZE_MIN    FONT_SIZE_INIT/2
 #define FONT_RESIZE_MAX    FONT_SIZE_INIT*2
+#define FONT_SIZES_NUM     ((FONT_RESIZE_MAX - FONT_RESIZE_MIN)/FONT_RESIZE_FACTOR + 1)
+#define FONT_GLYPHS_NUM    95
+#define FONT_GLYPH_PADDING 4
+#define FONT_SDF_SIZE      32
 
-enum {
-    UNDO_ACTION_DELETE_CHAR = 0,
-    UNDO_ACTION_APPEND_CHAR,
-};
+#define ZOOM_MIN  0.5f
+#define ZOOM_MAX  4.0f
+#define ZOOM_STEP 0.1f
+
+// Smooths the distance field stored in the atlas alpha over one screen pixel
+#define SDF_SHADER_FS                                                                       \
+    "#version 330\n"                                                                        \
+    "in vec2 fragTexCoord;\n"                                                               \
+    "in vec4 fragColor;\n"                                                                  \
+    "uniform sampler2D texture0;\n"                                                         \
+    "out vec4 finalColor;\n"                                                                \
+    "void main()\n"                                                                         \
+    "{\n"                                                                                   \
+    "    float distance = texture(texture0, fragTexCoord).a - 0.5;\n"                       \
+    "    float width = length(vec2(dFdx(distance), dFdy(distance)));\n"                     \
+    "    float alpha = smoothstep(-width, width, distance);\n"                              \
+    "    finalColor = vec4(fragColor.rgb, fragColor.a*alpha);\n"                            \
+    "}\n"
 
 enum {
     RESIZE_ACTION_INCREASE = 0,
     RESIZE_ACTION_DECREASE,
 };
 
-typedef char *Line;
+enum {
+    EDIT_RECORD   = 1 << 0,
+    EDIT_COALESCE = 1 << 1,
+};
+
+enum {
+    FONT_SLOT_EMPTY = 0,
+    FONT_SLOT_RASTERIZED,
+    FONT_SLOT_LOADED,
+};
+
+enum {
+    PIECE_SOURCE_ORIGINAL = 0,
+    PIECE_SOURCE_ADD,
+};
+
+enum {
+    SAVE_SYNC_NONE = 0,
+    SAVE_SYNC_FILE,
+    SAVE_SYNC_DIRECTORY,
+};
+
+typedef void (*ParallelJob)(void *, int);
+
+typedef struct ParallelRun {
+    ParallelJob job;
+    void *ctx;
+    int count;
+    atomic_int next;
+} ParallelRun;
+
+// Offsets just past every '\n' in some text, in ascending order
+typedef struct LineStarts {
+    uint64_t *offsets;
+    uint64_t num;
+    uint64_t capacity;
+} LineStarts;
+
+typedef struct NewlineScan {
+    const char *data;
+    uint64_t from;
+    uint64_t to;
+    uint64_t chunk_size;
+    LineStarts *chunks;
+} NewlineScan;
+
+// Stretch of a file indexed by the loader thread, ending at `to`, waiting to be
+// added to the buffer
+typedef struct LoadBatch {
+    uint64_t to;
+    LineStarts lines;
+} LoadBatch;
+
+// Indexes the rest of a big file after its first screenful has been opened
+typedef struct FileLoader {
+    pthread_t thread;
+    bool running;
+    atomic_bool cancel;
+
+    const char *data;
+    uint64_t from;
+    uint64_t len;
+    atomic_uint_fast64_t scanned;
+
+    pthread_mutex_t lock;
+    LoadBatch *batches;
+    int batches_num;
+    int batches_capacity;
+    bool finished;
+} FileLoader;
+
+// A signature per TRIGRAM_BLOCK_SIZE block of a source, with the bits of every
+// trigram starting in the block or in the FIND_QUERY_MAX bytes after it, so all
+// the trigrams of a match starting in a block are in its signature. Blocks below
+// `ready` are complete; the original is indexed on its own thread, the add
+// buffer as it is appended to.
+typedef struct TrigramIndex {
+    uint64_t *bits;
+    uint64_t blocks;
+    atomic_uint_fast64_t ready;
+
+    pthread_t thread;
+    bool running;
+    atomic_bool cancel;
+    const char *data;
+    uint64_t len;
+} TrigramIndex;
+
+// The blocks from `first` on that one parallel_for indexes
+typedef struct TrigramGroup {
+    TrigramIndex *index;
+    uint64_t first;
+} TrigramGroup;
+
+// Backing storage for pieces; text is only ever appended. While pinned, a
+// background reader may hold the data pointer, so growing keeps the old block.
+// Each reader holds its own pin.
+typedef struct TextBuffer {
+    char *data;
+    uint64_t len;
+    uint64_t capacity;
+    bool mapped;
+    // Open file behind a mapped buffer, so saves can copy from it in the kernel
+    int fd;
+
+    int pins;
+    char **retired;
+    int retired_num;
+
+    LineStarts lines;
+    TrigramIndex trigrams;
+} TextBuffer;
+
+typedef struct Piece {
+    int source;
+    uint64_t start;
+    uint64_t len;
+    uint64_t newlines;
+} Piece;
+
+// B-tree node; every slot caches the byte and newline count beneath it.
+// Slots past PIECE_NODE_MAX are headroom for an insert before the split.
+// Nodes are shared with undo snapshots and copied before being changed.
+typedef struct PieceNode {
+    int refs;
+    bool leaf;
+    int count;
+    uint64_t bytes[PIECE_NODE_MAX + 2];
+    uint64_t newlines[PIECE_NODE_MAX + 2];
+    union {
+        Piece pieces[PIECE_NODE_MAX + 2];
+        struct PieceNode *children[PIECE_NODE_MAX + 2];
+    };
+} PieceNode;
+
+typedef struct PieceTable {
+    TextBuffer sources[2];
+    PieceNode *root;
+
+    uint64_t len;
+    uint64_t newlines;
+} PieceTable;
+
+// Pieces queued for one writev, written straight from their source buffers.
+// Long spans of the original file are copied file to file instead.
+typedef struct PieceWriter {
+    int fd;
+    const char *sources[2];
+    int splice_fd;
+    struct iovec iov[SAVE_IOV_MAX];
+    int count;
+    bool failed;
+    atomic_uint_fast64_t *written;
+} PieceWriter;
+
+// A save running on its own thread from a snapshot of the piece tree. Only the
+// writer touches the file; the editor picks up the result once `done` is set.
+typedef struct SaveJob {
+    pthread_t thread;
+    bool running;
+    bool queued;
+    atomic_bool done;
+
+    PieceNode *root;
+    const char *sources[2];
+    int splice_fd;
+    uint64_t len;
+    atomic_uint_fast64_t written;
+
+    char path[PATH_MAX];
+    // The file itself, with symlinks resolved, so the rename replaces it and not a link
+    char target[PATH_MAX];
+    int sync;
+    int fd;
+    int error;
+    bool synced;
+
+    uint64_t edits;
+} SaveJob;
+
+// One rasterized font size; the lock is held while its glyphs are generated
+typedef struct FontSlot {
+    int size;
+    bool sdf;
+    bool baked;
+    atomic_int status;
+    pthread_mutex_t lock;
+
+    GlyphInfo *glyphs;
+    Rectangle *recs;
+    Image atlas;
+    Font font;
+} FontSlot;
+
+typedef struct FontCache {
+    FontSlot slots[FONT_SIZES_NUM];
+    FontSlot sdf;
+    pthread_t prewarm;
+    bool prewarming;
+    atomic_bool cancel;
+} FontCache;
+
+// Replaces deleted_len bytes at offset with the inserted text
+typedef struct Edit {
+    uint64_t offset;
+    const char *deleted;
+    uint64_t deleted_len;
+    const char *inserted;
+    uint64_t inserted_len;
+} Edit;
+
+// Undo history as a byte log of varint-packed records, one per undoable step:
+//   edit count, then per edit: offset, deleted length, deleted bytes,
+//   inserted length, inserted bytes
+// Each record ends with its own length written back to front, so the log is
+// walked from the end.
+typedef struct OpLog {
+    unsigned char *data;
+    uint64_t len;
+    uint64_t capacity;
+} OpLog;
+
+// Saved history lives next to the file as this header followed by the undo log
+// bytes. It is only trusted while the file still has the size and mtime recorded.
+typedef struct UndoSidecarHeader {
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t log_len;
+} UndoSidecarHeader;
+
+// One state in the undo tree; its record turns the parent's text into this one's.
+// Jump pointers form a skew-binary skip list over the ancestors, so any ancestor
+// or common ancestor is found in O(log depth).
+typedef struct UndoNode {
+    int64_t parent;
+    int64_t jump;
+    int64_t depth;
+    // Child last moved to, which redo follows
+    int64_t child;
+    double time;
+
+    uint64_t record;
+    uint64_t record_len;
+    // End of the record in the sidecar log, while the node is on the saved path
+    uint64_t sidecar;
+
+    // Piece tree as of this state, taken every UNDO_SNAPSHOT_INTERVAL steps
+    PieceNode *snapshot;
+    int64_t since;
+} UndoNode;
+
+typedef struct UndoJournal {
+    // Every state the buffer has been in, in the order they were first reached
+    UndoNode *nodes;
+    int64_t nodes_num;
+    int64_t nodes_capacity;
+    int64_t current;
+    OpLog records;
+
+    // Records from the sidecar, leading up to the root. They stay in the mapping
+    // and are only read once undo walks back past the root.
+    unsigned char *disk;
+    uint64_t disk_len;
+    void *map;
+    uint64_t map_len;
+    // Node whose path from the root is what the sidecar holds, and the one a
+    // background save is writing out, if any
+    int64_t saved;
+    int64_t saving;
+
+    // Edit still being coalesced from keystrokes; written to the log when sealed
+    bool open;
+    uint64_t offset;
+    OpLog deleted;
+    OpLog inserted;
+} UndoJournal;
+
+// Position and length of the cursor line. Edits on that line adjust it in
+// place; anything that reshapes lines marks it invalid to be looked up again.
+typedef struct LineCache {
+    int64_t line;
+    uint64_t start;
+    uint64_t len;
+    bool valid;
+} LineCache;
+
+// Looks for the next occurrence of needle at or after `from`, or counts the ones
+// starting in [from, to), piece by piece. Matches that span pieces are caught
+// in a window read around each boundary.
+typedef struct PieceSearch {
+    PieceTable *table;
+    const char *needle;
+    uint64_t len;
+    // Trigram bits every block the needle can start in has set
+    uint64_t mask[TRIGRAM_WORDS];
+    uint64_t from;
+    uint64_t found;
+
+    uint64_t to;
+    uint64_t before;
+    uint64_t count;
+    uint64_t preceding;
+} PieceSearch;
 
-typedef struct UndoAction {
-    int type;
-    int line;
-    int cursor;
-    char ch;
-} UndoAction;
+// Incremental search; every change to the query searches again from `origin`.
+// A regex query is searched in the background and its matches listed instead.
+typedef struct FindState {
+    bool active;
+    bool regex;
+    char query[FIND_QUERY_MAX];
+    int len;
+    // With Ctrl+H, typing goes to the replacement and Enter replaces every match
+    bool replacing;
+    char replacement[FIND_QUERY_MAX];
+    int replacement_len;
+    uint64_t origin;
+    uint64_t match;
+    // Matches in the buffer, kept up to date through edits, and which of them
+    // the cursor is on, counting from 1; 0 when that is not known
+    uint64_t count;
+    uint64_t index;
+} FindState;
 
-typedef struct _UndoBuffer {
-    UndoAction action;
-    struct _UndoBuffer *next;
-} UndoBuffer;
+typedef struct SearchMatch {
+    uint64_t offset;
+    uint64_t len;
+    int64_t line;
+} SearchMatch;
+
+// Regex search over a snapshot of the piece tree. Workers take the lines starting
+// in each SEARCH_CHUNK_SIZE stretch and hand their matches over under the lock;
+// the editor moves them into `matches`, kept in order, every frame.
+typedef struct SearchJob {
+    pthread_t thread;
+    bool running;
+    atomic_bool cancel;
+    atomic_bool done;
+    atomic_uint_fast64_t searched;
+
+    char pattern[FIND_QUERY_MAX + 1];
+    char error[128];
+    PieceTable table;
+    uint64_t len;
+    uint64_t edits;
+
+    pthread_mutex_t lock;
+    SearchMatch *found;
+    int found_num;
+    int found_capacity;
+    // Matches handed over in all, which SEARCH_MATCH_MAX caps
+    int found_total;
+    bool truncated;
+
+    SearchMatch *matches;
+    int matches_num;
+    int matches_capacity;
+    int selected;
+} SearchJob;
+
+// What one chunk of a replace-all changes: an edit per line with a match, from
+// its first match to the end of its last, pointing into the chunk's text
+typedef struct ReplaceChunk {
+    char *text;
+    OpLog inserted;
+    Edit *edits;
+    uint64_t edits_num;
+    uint64_t edits_capacity;
+    uint64_t matches;
+} ReplaceChunk;
+
+typedef struct ReplaceJob {
+    PieceTable *table;
+    const char *needle;
+    uint64_t needle_len;
+    const char *replacement;
+    uint64_t replacement_len;
+    ReplaceChunk *chunks;
+} ReplaceJob;
+
+// The key held down for repeating and when it next fires
+typedef struct KeyRepeat {
+    int key;
+    double next;
+} KeyRepeat;
 
 typedef struct LedState {
     const char *title;
@@ -51,54 +506,247 @@ typedef struct LedState {
     bool exit;
     LedTheme theme;
 
-    Line *lines;
-    int lines_capacity;
-    int lines_num;
+    PieceTable buffer;
+    int64_t lines_num;
+    LineCache line_cache;
 
-    int line;
+    char *line_buffer;
+    size_t line_buffer_capacity;
+
+    int64_t line;
     int line_scroll;
-    int cursor;
-    int repeat_cooldown;
+    // Line at the top of the screen. Text is drawn relative to it, with the
+    // camera at the origin, so positions stay small enough for float.
+    int64_t top_line;
+    int64_t cursor;
+    KeyRepeat repeat;
+    FindState find;
+    SearchJob search;
 
+    FontCache fonts;
     Font font;
     int font_size;
 
+    Font sdf_font;
+    Shader sdf_shader;
+    bool sdf_active;
+
     bool dirty;
+    uint64_t edits;
+    int save_sync;
+    SaveJob save;
+    FileLoader loader;
+    char status[128];
 
     Camera2D camera;
+    bool waiting_events;
 
-    UndoBuffer *undo;
+    UndoJournal undo;
 } LedState;
 
-UndoBuffer *undo_init(void);
-UndoBuffer *undo_append(UndoBuffer *, UndoAction);
-UndoBuffer *undo_delete(UndoBuffer *);
-void undo_free(UndoBuffer *);
+int varint_encode(uint64_t, unsigned char *);
+const unsigned char *varint_decode(const unsigned char *, uint64_t *);
+const unsigned char *varint_decode_checked(const unsigned char *, const unsigned char *, uint64_t *);
+void op_log_reserve(OpLog *, uint64_t);
+void op_log_push(OpLog *, const void *, uint64_t);
+void op_log_push_varint(OpLog *, uint64_t);
+void op_log_end_record(OpLog *, uint64_t);
+uint64_t op_log_last_record(OpLog *);
+void op_log_write_record(OpLog *, Edit *, uint64_t);
+Edit *op_log_read_record(const unsigned char *, uint64_t *);
+void op_log_free(OpLog *);
+
+void undo_journal_init(UndoJournal *);
+void undo_journal_free(UndoJournal *);
+void undo_journal_seal(UndoJournal *);
+void undo_journal_record(UndoJournal *, Edit, bool);
+void undo_journal_add(UndoJournal *, Edit *, uint64_t);
+void undo_journal_link(UndoJournal *, int64_t);
+int64_t undo_journal_ancestor(UndoJournal *, int64_t, int64_t);
+int64_t undo_journal_common(UndoJournal *, int64_t, int64_t);
+int64_t undo_journal_snapshot_near(UndoJournal *, int64_t);
+bool undo_journal_check(UndoJournal *, uint64_t);
+void undo_journal_adopt(UndoJournal *, uint64_t);
+void undo_sidecar_path(const char *, char *, size_t);
+void undo_journal_open(UndoJournal *, const char *);
+void undo_journal_persist(UndoJournal *, const char *, int64_t, bool);
+
+int get_worker_count(void);
+void *parallel_worker(void *);
+void parallel_for(int, ParallelJob, void *);
+
+void line_starts_push(LineStarts *, uint64_t);
+uint64_t scan_newlines_scalar(const char *, uint64_t, uint64_t, LineStarts *);
+#if SCAN_X86
+uint64_t scan_newlines_sse2(const char *, uint64_t, uint64_t, LineStarts *);
+uint64_t scan_newlines_avx2(const char *, uint64_t, uint64_t, LineStarts *);
+#endif
+void scan_newlines(const char *, uint64_t, uint64_t, LineStarts *);
+void scan_newlines_job(void *, int);
+void scan_newlines_parallel(const char *, uint64_t, uint64_t, LineStarts *);
+
+uint64_t find_bytes_scalar(const char *, uint64_t, const char *, uint64_t);
+#if SCAN_X86
+uint64_t find_bytes_sse2(const char *, uint64_t, const char *, uint64_t);
+uint64_t find_bytes_avx2(const char *, uint64_t, const char *, uint64_t);
+#endif
+uint64_t find_bytes(const char *, uint64_t, const char *, uint64_t);
+
+uint32_t trigram_hash(const char *);
+void trigram_signature(uint64_t *, const char *, uint64_t, uint64_t);
+void trigram_index_start(TrigramIndex *, const char *, uint64_t);
+void *trigram_index_thread(void *);
+void trigram_index_block(void *, int);
+void trigram_index_append(TrigramIndex *, const char *, uint64_t, uint64_t);
+bool trigram_index_may_match(TrigramIndex *, uint64_t, const uint64_t *);
+void trigram_index_free(TrigramIndex *);
+
+void text_buffer_index_lines(TextBuffer *, uint64_t);
+void text_buffer_append(TextBuffer *, const char *, uint64_t);
+uint64_t text_buffer_lower_bound(TextBuffer *, uint64_t);
+uint64_t text_buffer_count_newlines(TextBuffer *, uint64_t, uint64_t);
+void text_buffer_pin(TextBuffer *);
+void text_buffer_unpin(TextBuffer *);
+void text_buffer_free(TextBuffer *);
+
+Piece piece_slice(PieceTable *, Piece, uint64_t, uint64_t);
+PieceNode *piece_node_new(bool);
+PieceNode *piece_node_ref(PieceNode *);
+PieceNode *piece_node_own(PieceNode *);
+void piece_node_free(PieceNode *);
+void piece_node_sum(PieceNode *, uint64_t *, uint64_t *);
+void piece_node_open(PieceNode *, int, int);
+void piece_node_close(PieceNode *, int, int);
+void piece_node_set_piece(PieceNode *, int, Piece);
+void piece_node_set_child(PieceNode *, int, PieceNode *);
+PieceNode *piece_node_split(PieceNode *);
+void piece_node_rebalance(PieceNode *);
+PieceNode *piece_node_insert(PieceTable *, PieceNode *, uint64_t, Piece);
+PieceNode *piece_node_delete(PieceTable *, PieceNode *, uint64_t, uint64_t);
+void piece_writer_flush(PieceWriter *);
+void piece_writer_splice(PieceWriter *, Piece *);
+void piece_node_write(PieceWriter *, PieceNode *);
+
+void piece_table_set_root(PieceTable *, PieceNode *);
+void piece_table_init(PieceTable *, char *, uint64_t, bool);
+void piece_table_extend(PieceTable *, uint64_t, LineStarts *);
+void piece_table_free(PieceTable *);
+void piece_table_insert(PieceTable *, uint64_t, const char *, uint64_t);
+void piece_table_delete(PieceTable *, uint64_t, uint64_t);
+Piece *piece_table_locate(PieceTable *, uint64_t, uint64_t *);
+uint64_t piece_table_read(PieceTable *, uint64_t, uint64_t, char *);
+char *piece_table_read_lines(PieceTable *, uint64_t, uint64_t, uint64_t *, uint64_t *, uint64_t *);
+uint64_t piece_table_line_start(PieceTable *, uint64_t);
+uint64_t piece_table_line_length(PieceTable *, uint64_t);
+uint64_t piece_table_offset_line(PieceTable *, uint64_t);
+PieceNode *piece_table_snapshot(PieceTable *);
+void piece_table_restore(PieceTable *, PieceNode *);
+bool piece_node_find(PieceSearch *, PieceNode *, uint64_t);
+uint64_t piece_find(PieceSearch *, Piece *, uint64_t);
+void piece_search_init(PieceSearch *, PieceTable *, const char *, uint64_t, uint64_t);
+uint64_t piece_table_find(PieceTable *, const char *, uint64_t, uint64_t);
+void piece_count(PieceSearch *, Piece *, uint64_t, uint64_t, uint64_t);
+void piece_node_count(PieceSearch *, PieceNode *, uint64_t);
+uint64_t piece_table_count(PieceTable *, const char *, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t *);
+
+void font_slot_rasterize(FontSlot *);
+Font font_slot_load_baked(FontSlot *);
+void font_slot_prewarm(FontSlot *);
+Font font_slot_get(FontSlot *);
+void font_slot_free(FontSlot *);
+void *font_cache_prewarm(void *);
+void font_cache_init(FontCache *);
+void font_cache_start_prewarm(FontCache *);
+void font_cache_free(FontCache *);
+Font font_cache_get(FontCache *, int);
 
 void state_init(LedState *, const char *);
 void load_file(LedState *);
+void file_loader_start(FileLoader *, const char *, uint64_t, uint64_t);
+void *file_loader_thread(void *);
+void file_loader_stop(FileLoader *);
+void load_poll(LedState *);
 void state_deinit(LedState *);
 
-bool any_key_pressed(int *);
+void line_cache_update(LedState *);
+void line_cache_edit(LedState *, Edit);
+uint64_t get_line_start(LedState *, int64_t);
+uint64_t get_line_length(LedState *, int64_t);
+const char *get_line(LedState *, int64_t);
+uint64_t get_cursor_offset(LedState *);
+void set_cursor_offset(LedState *, uint64_t);
+
+bool is_char_key(int);
+bool is_arrow_key(int);
+void key_press(LedState *, int);
+int key_repeats(LedState *, int);
 
 void handle_editor_events(LedState *);
 void handle_cursor_movement(LedState *);
+void move_cursor(LedState *, int);
+bool is_repeating(LedState *);
+void update_event_waiting(LedState *);
 int get_number_lines_on_screen(LedState *);
 
 void new_line(LedState *);
+void edit_buffer(LedState *, uint64_t, uint64_t, const char *, uint64_t, int);
 void delete_char_cursor(LedState *, bool);
 void append_char_cursor(LedState *, int, bool);
 void delete_line(LedState *);
 void append_tab(LedState *);
+void paste_text(LedState *, const char *, uint64_t);
+void paste(LedState *);
+void copy_line(LedState *);
+void cut_line(LedState *);
+void scroll_to_cursor(LedState *);
+void find_start(LedState *, bool);
+void find_close(LedState *);
+void find_update(LedState *, uint64_t);
+void find_seek(LedState *, uint64_t);
+void find_next(LedState *);
+void find_recount(LedState *);
+bool find_counting(LedState *);
+uint64_t find_count_lines(LedState *, uint64_t, uint64_t);
+void find_count_edit(LedState *, uint64_t, uint64_t, uint64_t);
+void find_append(LedState *, int);
+void find_backspace(LedState *);
+void replace_start(LedState *);
+void replace_chunk(void *, int);
+uint64_t replace_all(LedState *, const char *, uint64_t, const char *, uint64_t);
+void find_replace(LedState *);
+void handle_find_events(LedState *);
+void search_start(LedState *);
+void *search_thread(void *);
+void search_chunk(void *, int);
+int search_match_compare(const void *, const void *);
+void search_poll(LedState *);
+void search_merge(SearchJob *, int);
+void search_finish(SearchJob *, PieceTable *);
+void search_stop(LedState *);
+void search_jump(LedState *, int);
 void write_file(LedState *);
+void *save_thread(void *);
+void save_poll(LedState *);
+void save_finish(LedState *);
+bool sync_directory(const char *);
+uint64_t apply_record(LedState *, const unsigned char *, bool);
+void undo_snapshot(LedState *);
+void undo_goto(LedState *, int64_t);
 void undo(LedState *);
+void redo(LedState *);
+void undo_travel(LedState *, double);
 void resize_font(LedState *, int action);
+void zoom_camera(LedState *, float);
 
 void move_to_start(LedState *);
 void move_to_end(LedState *);
 
+int line_y(LedState *, int64_t);
 void draw_text(LedState *, const char *, int, int, Color);
+float column_advance(LedState *);
 void draw_cursor(LedState *);
+void draw_matches(LedState *, int64_t, int64_t);
+void draw_jump_list(LedState *);
 void draw_hud(LedState *);
 
 int main(int argc, char **argv)
@@ -125,22 +773,40 @@ int main(int argc, char **argv)
     SetTargetFPS(FPS);
 
     while (!state.exit) {
-        ++state.repeat_cooldown;
-        state.repeat_cooldown %= REPEAT_COOLDOWN;
-
         handle_editor_events(&state);
 
         handle_cursor_movement(&state);
 
+        load_poll(&state);
+
+        save_poll(&state);
+
+        search_poll(&state);
+
+        update_event_waiting(&state);
+
         BeginDrawing();
         ClearBackground(state.theme.background_color);
 
+        // Only lines overlapping the camera rectangle are drawn
+        int64_t first_line = state.top_line;
+        int64_t last_line = first_line + GetScreenHeight()/(state.font_size*state.camera.zoom) + 1;
+        if (first_line < 0)
+            first_line = 0;
+        if (last_line > state.lines_num)
+            last_line = state.lines_num;
+
+        // Scaled text is drawn from the distance field atlas so it stays sharp
+        state.sdf_active = state.camera.zoom != 1.0f;
         BeginMode2D(state.camera);
-            for (int i = 0; i < state.lines_num; ++i)
-                draw_text(&state, state.lines[i], 0, i*state.font_size, state.theme.text_color);
+            draw_matches(&state, first_line, last_line);
+            for (int64_t i = first_line; i < last_line; ++i)
+                draw_text(&state, get_line(&state, i), 0, line_y(&state, i), state.theme.text_color);
             draw_cursor(&state);
         EndMode2D();
+        state.sdf_active = false;
 
+        draw_jump_list(&state);
         draw_hud(&state);
         EndDrawing();
     }
@@ -150,358 +816,3543 @@ int main(int argc, char **argv)
     return 0;
 }
 
-UndoBuffer *undo_init(void)
+int varint_encode(uint64_t value, unsigned char *bytes)
 {
-    return NULL;
-}
+    int len = 0;
+    do {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value)
+            bytes[len] |= 0x80;
+        ++len;
+    } while (value);
 
-UndoBuffer *undo_append(UndoBuffer *head, UndoAction action)
-{
-    UndoBuffer *node = malloc(sizeof(UndoBuffer));
-    node->action = action;
-    node->next = head;
-    return node;
+    return len;
 }
 
-UndoBuffer *undo_delete(UndoBuffer *head)
+const unsigned char *varint_decode(const unsigned char *bytes, uint64_t *value)
 {
-    if (!head)
-      return NULL;
+    *value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        byte = *bytes++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
 
-    UndoBuffer *node = head;
-    head = head->next;
-    free(node);
-    return head;
+    return bytes;
 }
 
-void undo_free(UndoBuffer *head)
+// Like varint_decode, for bytes read from disk: NULL if the varint runs past
+// `end` or does not fit 64 bits
+const unsigned char *varint_decode_checked(const unsigned char *bytes, const unsigned char *end, uint64_t *value)
 {
-    UndoBuffer *node = head;
-    while (node) {
-        UndoBuffer *tmp = node;
-        node = node->next;
-        free(tmp);
+    *value = 0;
+    for (int shift = 0; bytes < end && shift < 64; shift += 7) {
+        unsigned char byte = *bytes++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return bytes;
     }
+
+    return NULL;
 }
 
-void state_init(LedState *state, const char *filename)
+void op_log_reserve(OpLog *log, uint64_t len)
 {
-    state->filename = filename;
+    if (log->len + len <= log->capacity)
+        return;
 
-    state->cursor = 0;
-    state->repeat_cooldown = 0;
+    log->capacity = log->capacity? log->capacity : OP_LOG_INIT;
+    while (log->capacity < log->len + len)
+        log->capacity *= 2;
+    log->data = realloc(log->data, log->capacity);
+}
 
-    state->font_size = FONT_SIZE_INIT;
-    state->font = LoadFontFromMemory(".ttf", GeistMono_Regular_ttf, GeistMono_Regular_ttf_len, state->font_size, NULL, 95);
-    state->theme = themes[0];
+void op_log_push(OpLog *log, const void *bytes, uint64_t len)
+{
+    if (len == 0)
+        return;
 
-    state->line = -1;
-    state->lines_capacity = 100;
-    state->lines = calloc(state->lines_capacity, sizeof(Line));
-    state->line_scroll = 1;
+    op_log_reserve(log, len);
+    memcpy(log->data + log->len, bytes, len);
+    log->len += len;
+}
 
-    state->camera.offset = (Vector2){ 0.0f, 0.0f };
-    state->camera.target = (Vector2){ 0.0f, 0.0f };
-    state->camera.rotation = 0.0f;
-    state->camera.zoom = 1.0f;
+void op_log_push_varint(OpLog *log, uint64_t value)
+{
+    unsigned char bytes[10];
+    int len = varint_encode(value, bytes);
+    op_log_push(log, bytes, len);
+}
 
-    state->undo = undo_init();
+// Closes the record that started at `start` with its length, written back to
+// front so the log can be walked from its end
+void op_log_end_record(OpLog *log, uint64_t start)
+{
+    unsigned char bytes[10];
+    int len = varint_encode(log->len - start, bytes);
+    for (int i = len - 1; i >= 0; --i)
+        op_log_push(log, &bytes[i], 1);
+}
 
-    if (FileExists(state->filename)) {
-        load_file(state);
-        state->line = 0;
-        return;
-    }
+// Start of the last record in the log
+uint64_t op_log_last_record(OpLog *log)
+{
+    uint64_t end = log->len, len = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        byte = log->data[--end];
+        len |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
 
-    new_line(state);
+    return end - len;
 }
 
-void load_file(LedState *state)
+void op_log_free(OpLog *log)
 {
-    FILE *f = fopen(state->filename, "r");
-    char buffer[LINE_SIZE] = { 0 };
+    free(log->data);
+    *log = (OpLog){ 0 };
+}
 
-    while (fgets(buffer, LINE_SIZE, f) != NULL) {
-        state->lines[state->lines_num] = calloc(LINE_SIZE, sizeof(char));
-        int line_len = strlen(buffer);
-        strncpy(state->lines[state->lines_num], buffer, line_len - 1);
+void op_log_write_record(OpLog *log, Edit *edits, uint64_t count)
+{
+    uint64_t start = log->len;
+    op_log_push_varint(log, count);
+    for (uint64_t i = 0; i < count; ++i) {
+        op_log_push_varint(log, edits[i].offset);
+        op_log_push_varint(log, edits[i].deleted_len);
+        op_log_push(log, edits[i].deleted, edits[i].deleted_len);
+        op_log_push_varint(log, edits[i].inserted_len);
+        op_log_push(log, edits[i].inserted, edits[i].inserted_len);
+    }
+    op_log_end_record(log, start);
+}
 
-        ++state->lines_num;
-        if (state->lines_num >= state->lines_capacity/2) {
-            state->lines_capacity *= 2;
-            state->lines = realloc(state->lines, state->lines_capacity*sizeof(Line));
-        }
+// Decodes a record into a freshly allocated edit array pointing into the record
+Edit *op_log_read_record(const unsigned char *record, uint64_t *count)
+{
+    record = varint_decode(record, count);
+    Edit *edits = malloc(*count*sizeof(Edit));
+    for (uint64_t i = 0; i < *count; ++i) {
+        Edit *edit = &edits[i];
+        record = varint_decode(record, &edit->offset);
+        record = varint_decode(record, &edit->deleted_len);
+        edit->deleted = (const char *)record;
+        record += edit->deleted_len;
+        record = varint_decode(record, &edit->inserted_len);
+        edit->inserted = (const char *)record;
+        record += edit->inserted_len;
     }
 
-    fclose(f);
+    return edits;
 }
 
-void state_deinit(LedState *state)
+void undo_journal_init(UndoJournal *journal)
 {
-    UnloadFont(state->font);
-    state->font_size = 0;
+    *journal = (UndoJournal){ 0 };
 
-    for (int i = 0; i < state->lines_num; ++i)
-        free(state->lines[i]);
-
-    free(state->lines);
-    state->lines_capacity = 0;
-    state->lines_num = 0;
-    state->line = 0;
-    state->cursor = 0;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    undo_free(state->undo);
+    journal->nodes_capacity = 64;
+    journal->nodes = malloc(journal->nodes_capacity*sizeof(UndoNode));
+    journal->nodes_num = 1;
+    journal->nodes[0] = (UndoNode){
+        .parent = -1,
+        .child = -1,
+        .time = now.tv_sec + now.tv_nsec/1e9,
+        .since = UNDO_SNAPSHOT_INTERVAL,
+    };
+    journal->saving = -1;
+    undo_journal_link(journal, 0);
 }
 
-bool any_key_pressed(int *key)
+void undo_journal_free(UndoJournal *journal)
 {
-    *key = GetKeyPressed();
-    return *key >= ' ' && *key <= KEY_KB_MENU;
+    if (journal->map)
+        munmap(journal->map, journal->map_len);
+    for (int64_t i = 0; i < journal->nodes_num; ++i)
+        if (journal->nodes[i].snapshot)
+            piece_node_free(journal->nodes[i].snapshot);
+    free(journal->nodes);
+    op_log_free(&journal->records);
+    op_log_free(&journal->deleted);
+    op_log_free(&journal->inserted);
+    *journal = (UndoJournal){ 0 };
 }
 
-void handle_editor_events(LedState *state)
+// Writes out the edit still being coalesced, if any
+void undo_journal_seal(UndoJournal *journal)
 {
-    if (IsKeyDown(KEY_LEFT_CONTROL)) {
-        if (IsKeyPressed(KEY_Q))
-            state->exit = true;
-        else if (IsKeyPressed(KEY_D))
-            delete_line(state);
-        else if (IsKeyPressed(KEY_S))
-            write_file(state);
-        else if (IsKeyPressed(KEY_Z))
-            undo(state);
-        else if (IsKeyPressed(KEY_K))
-            resize_font(state, RESIZE_ACTION_INCREASE);
-        else if (IsKeyPressed(KEY_J))
-            resize_font(state, RESIZE_ACTION_DECREASE);
-        else if (IsKeyDown(KEY_T))
-            if (IsKeyPressed(KEY_ONE))
-                state->theme = themes[0];
-            else if (IsKeyPressed(KEY_TWO))
-                state->theme = themes[1];
+    if (!journal->open)
+        return;
+
+    // Backspaced text was collected back to front
+    OpLog *deleted = &journal->deleted;
+    for (uint64_t i = 0; i < deleted->len/2; ++i) {
+        unsigned char tmp = deleted->data[i];
+        deleted->data[i] = deleted->data[deleted->len - 1 - i];
+        deleted->data[deleted->len - 1 - i] = tmp;
     }
 
-    if (IsKeyDown(KEY_BACKSPACE) && state->cursor > 0 &&
-            state->repeat_cooldown % REPEAT_COOLDOWN == 0)
-        delete_char_cursor(state, true);
+    Edit edit = {
+        .offset = journal->offset,
+        .deleted = (const char *)deleted->data,
+        .deleted_len = deleted->len,
+        .inserted = (const char *)journal->inserted.data,
+        .inserted_len = journal->inserted.len,
+    };
+    undo_journal_add(journal, &edit, 1);
 
-    if (IsKeyPressed(KEY_TAB))
-        append_tab(state);
+    journal->deleted.len = 0;
+    journal->inserted.len = 0;
+    journal->open = false;
+}
 
-    if (state->cursor < 0)
-        state->cursor = 0;
+// Records one edit. With `coalesce`, typing forwards or backspacing backwards
+// right where the previous such edit stopped grows it instead of adding a record.
+void undo_journal_record(UndoJournal *journal, Edit edit, bool coalesce)
+{
+    bool typing = edit.deleted_len == 0;
+    bool erasing = edit.inserted_len == 0;
+    if (coalesce && journal->open) {
+        if (typing && journal->deleted.len == 0 && journal->offset + journal->inserted.len == edit.offset) {
+            op_log_push(&journal->inserted, edit.inserted, edit.inserted_len);
+            return;
+        }
+        if (erasing && journal->inserted.len == 0 && edit.offset + edit.deleted_len == journal->offset) {
+            for (uint64_t i = edit.deleted_len; i > 0; --i)
+                op_log_push(&journal->deleted, &edit.deleted[i - 1], 1);
+            journal->offset = edit.offset;
+            return;
+        }
+    }
 
-    int key;
-    if (any_key_pressed(&key)) {
-        int c = GetCharPressed();
-        if (key == KEY_ENTER)
-            new_line(state);
-        else if (c >= ' ' && c <= '~')
-            append_char_cursor(state, c, true);
+    undo_journal_seal(journal);
+    if (coalesce && (typing || erasing)) {
+        journal->open = true;
+        journal->offset = edit.offset;
+        op_log_push(&journal->inserted, edit.inserted, edit.inserted_len);
+        for (uint64_t i = edit.deleted_len; i > 0; --i)
+            op_log_push(&journal->deleted, &edit.deleted[i - 1], 1);
+        return;
     }
+
+    undo_journal_add(journal, &edit, 1);
 }
 
-void handle_cursor_movement(LedState *state)
+// Adds a node for the record below the current one and moves to it. Whatever
+// was undone before stays in the tree as a sibling branch.
+void undo_journal_add(UndoJournal *journal, Edit *edits, uint64_t count)
 {
-    int current_line_len = strlen(state->lines[state->line]);
-
-    if (IsKeyDown(KEY_LEFT) && state->repeat_cooldown % REPEAT_COOLDOWN == 0)
-        state->cursor -= state->cursor > 0? 1 : 0;
-    else if (IsKeyDown(KEY_RIGHT) && state->repeat_cooldown % REPEAT_COOLDOWN == 0)
-        state->cursor += state->cursor < current_line_len? 1 : 0;
-    else if (IsKeyDown(KEY_UP) && state->repeat_cooldown % REPEAT_COOLDOWN == 0) {
-        if (state->line > 0) {
-            int line_above_len = strlen(state->lines[state->line - 1]);
-            --state->line;
+    uint64_t start = journal->records.len;
+    op_log_write_record(&journal->records, edits, count);
 
-            --state->line_scroll;
-            if (state->line_scroll <= 0) {
-                state->camera.target.y -= state->font_size;
-                state->line_scroll = 1;
-            }
+    if (journal->nodes_num == journal->nodes_capacity) {
+        journal->nodes_capacity *= 2;
+        journal->nodes = realloc(journal->nodes, journal->nodes_capacity*sizeof(UndoNode));
+    }
 
-            if (state->cursor > line_above_len)
-                state->cursor = line_above_len;
-        } else
-            state->cursor = 0;
-    } else if (IsKeyDown(KEY_DOWN) && state->repeat_cooldown % REPEAT_COOLDOWN == 0) {
-        if (state->lines[state->line + 1]) {
-            int line_below_len = strlen(state->lines[state->line + 1]);
-            ++state->line;
-            ++state->line_scroll;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-            if (state->line_scroll > get_number_lines_on_screen(state)) {
-                state->camera.target.y += state->font_size;
-                --state->line_scroll;
-            }
+    int64_t node = journal->nodes_num++;
+    UndoNode *parent = &journal->nodes[journal->current];
+    journal->nodes[node] = (UndoNode){
+        .parent = journal->current,
+        .child = -1,
+        .time = now.tv_sec + now.tv_nsec/1e9,
+        .record = start,
+        .record_len = journal->records.len - start,
+        .since = parent->since + 1,
+    };
+    parent->child = node;
+    undo_journal_link(journal, node);
+    journal->current = node;
+}
 
-            if (state->cursor > line_below_len)
-                state->cursor = line_below_len;
-        } else
-            state->cursor = strlen(state->lines[state->line]);
+// Sets depth and jump pointer from the parent, which must already be linked
+void undo_journal_link(UndoJournal *journal, int64_t node)
+{
+    UndoNode *nodes = journal->nodes;
+    int64_t parent = nodes[node].parent;
+    if (parent < 0) {
+        nodes[node].depth = 0;
+        nodes[node].jump = node;
+        return;
     }
 
-    if (IsKeyPressed(KEY_PAGE_DOWN)) {
-        int lines_on_screen = get_number_lines_on_screen(state);
-        state->line_scroll = 1;
-        state->line += lines_on_screen;
+    int64_t jump = nodes[parent].jump;
+    int64_t next = nodes[jump].jump;
+    nodes[node].depth = nodes[parent].depth + 1;
+    if (nodes[parent].depth - nodes[jump].depth == nodes[jump].depth - nodes[next].depth)
+        nodes[node].jump = next;
+    else
+        nodes[node].jump = parent;
+}
 
-        if (state->line > state->lines_num)
-            state->line = state->lines_num - 1;
+int64_t undo_journal_ancestor(UndoJournal *journal, int64_t node, int64_t depth)
+{
+    UndoNode *nodes = journal->nodes;
+    if (depth < 0)
+        depth = 0;
 
-        state->cursor = strlen(state->lines[state->line]);
-        state->camera.target.y = state->font_size*state->line;
+    while (nodes[node].depth > depth) {
+        int64_t jump = nodes[node].jump;
+        node = nodes[jump].depth >= depth? jump : nodes[node].parent;
     }
 
-    if (IsKeyPressed(KEY_PAGE_UP)) {
-        int lines_on_screen = get_number_lines_on_screen(state);
-        state->line_scroll = 1;
-        state->line -= lines_on_screen;
+    return node;
+}
 
-        if (state->line < 0)
-            state->line = 0;
+int64_t undo_journal_common(UndoJournal *journal, int64_t a, int64_t b)
+{
+    UndoNode *nodes = journal->nodes;
+    a = undo_journal_ancestor(journal, a, nodes[b].depth);
+    b = undo_journal_ancestor(journal, b, nodes[a].depth);
 
-        state->cursor = strlen(state->lines[state->line]);
-        state->camera.target.y = state->font_size*state->line;
+    // Nodes at equal depth have jumps of equal length; differing targets mean
+    // the common ancestor is further up still
+    while (a != b) {
+        if (nodes[a].jump != nodes[b].jump) {
+            a = nodes[a].jump;
+            b = nodes[b].jump;
+        } else {
+            a = nodes[a].parent;
+            b = nodes[b].parent;
+        }
     }
 
-    if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_ZERO))
-        move_to_start(state);
-
-    if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_E))
-        move_to_end(state);
+    return a;
 }
 
-int get_number_lines_on_screen(LedState *state)
+// Closest snapshot on the way up from node, if one is near enough to replay from
+int64_t undo_journal_snapshot_near(UndoJournal *journal, int64_t node)
 {
-    int num_lines = GetScreenHeight()/state->font_size;
-    return num_lines - 1;
+    for (int i = 0; node >= 0 && i <= 2*UNDO_SNAPSHOT_INTERVAL; ++i) {
+        if (journal->nodes[node].snapshot)
+            return node;
+        node = journal->nodes[node].parent;
+    }
+
+    return -1;
 }
 
-void new_line(LedState *state)
+// Whether the sidecar records decode within the log and undo cleanly, one after
+// another, from the root's text of `len` bytes
+bool undo_journal_check(UndoJournal *journal, uint64_t len)
 {
-    Line new = calloc(LINE_SIZE, sizeof(char));
-    ++state->lines_num;
+    const unsigned char *disk = journal->disk;
+    uint64_t end = journal->disk_len;
+    while (end > 0) {
+        // The record length is written back to front after the record
+        uint64_t record_len = 0, at = end;
+        unsigned char byte;
+        int shift = 0;
+        do {
+            if (at == 0 || shift >= 64)
+                return false;
+            byte = disk[--at];
+            record_len |= (uint64_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        if (record_len > at)
+            return false;
 
-    for (int i = state->lines_num; i > state->line; --i)
-        state->lines[i] = state->lines[i - 1];
+        const unsigned char *record = disk + at - record_len, *record_end = disk + at;
+        uint64_t count;
+        record = varint_decode_checked(record, record_end, &count);
+        if (!record || count > record_len)
+            return false;
 
-    ++state->line;
-    ++state->line_scroll;
-    if (state->lines_num >= state->lines_capacity/2) {
-        state->lines_capacity *= 2;
-        state->lines = realloc(state->lines, state->lines_capacity*sizeof(Line));
+        // Edits are undone last to first, each replacing its inserted text
+        Edit *edits = malloc(count*sizeof(Edit));
+        bool valid = true;
+        for (uint64_t i = 0; i < count && valid; ++i) {
+            Edit *edit = &edits[i];
+            valid = (record = varint_decode_checked(record, record_end, &edit->offset))
+                && (record = varint_decode_checked(record, record_end, &edit->deleted_len))
+                && edit->deleted_len <= (uint64_t)(record_end - record)
+                && (record = varint_decode_checked(record + edit->deleted_len, record_end, &edit->inserted_len))
+                && edit->inserted_len <= (uint64_t)(record_end - record);
+            if (valid)
+                record += edit->inserted_len;
+        }
+        valid = valid && record == record_end;
+        for (uint64_t i = count; valid && i > 0; --i) {
+            Edit *edit = &edits[i - 1];
+            valid = edit->offset <= len && edit->inserted_len <= len - edit->offset;
+            len = len - edit->inserted_len + edit->deleted_len;
+        }
+        free(edits);
+        if (!valid)
+            return false;
+
+        end = at - record_len;
     }
 
-    state->lines[state->line] = new;
-    state->cursor = 0;
+    return true;
 }
 
-void delete_char_cursor(LedState *state, bool undo)
+// Turns the sidecar records into a chain of nodes above the root. The states
+// they lead to were never timed, so they sort before everything else. The root
+// has `len` bytes; a log that does not fit it is dropped with the history.
+void undo_journal_adopt(UndoJournal *journal, uint64_t len)
 {
-    Line line = state->lines[state->line];
-    int line_len = strlen(line);
-    if (line_len < 1)
+    if (journal->disk_len == 0)
         return;
 
-    if (undo) {
-        UndoAction action = {
-            .type = UNDO_ACTION_DELETE_CHAR,
-            .line = state->line,
-            .cursor = state->cursor,
-            .ch = line[state->cursor - 1],
-        };
-        state->undo = undo_append(state->undo, action);
+    if (!undo_journal_check(journal, len)) {
+        for (int64_t i = 0; i < journal->nodes_num; ++i)
+            journal->nodes[i].sidecar = 0;
+        munmap(journal->map, journal->map_len);
+        journal->map = NULL;
+        journal->map_len = 0;
+        journal->disk = NULL;
+        journal->disk_len = 0;
+        return;
     }
 
-    for (int i = state->cursor - 1; i < line_len; ++i)
-        line[i] = line[i + 1];
+    int64_t count = 0;
+    for (OpLog view = { journal->disk, journal->disk_len, 0 }; view.len; view.len = op_log_last_record(&view))
+        ++count;
 
-    --state->cursor;
-    state->dirty = true;
-}
+    if (journal->nodes_num + count > journal->nodes_capacity) {
+        while (journal->nodes_num + count > journal->nodes_capacity)
+            journal->nodes_capacity *= 2;
+        journal->nodes = realloc(journal->nodes, journal->nodes_capacity*sizeof(UndoNode));
+    }
 
-void append_char_cursor(LedState *state, int c, bool undo)
-{
-    Line line = state->lines[state->line];
-    int line_len = strlen(line);
+    // Existing nodes move up by count so creation order still matches index order
+    UndoNode *nodes = journal->nodes;
+    memmove(nodes + count, nodes, journal->nodes_num*sizeof(UndoNode));
+    for (int64_t i = count; i < journal->nodes_num + count; ++i) {
+        if (nodes[i].parent >= 0)
+            nodes[i].parent += count;
+        if (nodes[i].child >= 0)
+            nodes[i].child += count;
+    }
+    journal->nodes_num += count;
+    journal->current += count;
+    journal->saved += count;
+    if (journal->saving >= 0)
+        journal->saving += count;
 
-    if (undo) {
-        UndoAction action = {
-            .type = UNDO_ACTION_APPEND_CHAR,
-            .line = state->line,
-            .cursor = state->cursor,
-            .ch = c,
-        };
-        state->undo = undo_append(state->undo, action);
+    // The oldest state gets no record; node i is reached by the i-th record
+    OpLog view = { journal->disk, journal->disk_len, 0 };
+    for (int64_t i = count; i >= 0; --i) {
+        if (i < count) {
+            nodes[i] = (UndoNode){
+                .child = i + 1,
+                .since = i % UNDO_SNAPSHOT_INTERVAL? 0 : UNDO_SNAPSHOT_INTERVAL,
+            };
+        }
+        nodes[i].parent = i - 1;
+        nodes[i].sidecar = view.len;
+        if (i == 0)
+            break;
+
+        uint64_t start = op_log_last_record(&view);
+        nodes[i].record = journal->records.len;
+        nodes[i].record_len = view.len - start;
+        op_log_push(&journal->records, view.data + start, view.len - start);
+        view.len = start;
     }
 
-    for (int i = line_len; i > state->cursor; --i)
-        line[i] = line[i - 1];
+    for (int64_t i = 0; i < journal->nodes_num; ++i)
+        undo_journal_link(journal, i);
 
-    line[state->cursor++] = c;
-    state->dirty = true;
+    munmap(journal->map, journal->map_len);
+    journal->map = NULL;
+    journal->map_len = 0;
+    journal->disk = NULL;
+    journal->disk_len = 0;
 }
 
-void delete_line(LedState *state)
+// Hidden sibling of the file: dir/.name.led-undo
+void undo_sidecar_path(const char *filename, char *path, size_t size)
 {
-    Line line = state->lines[state->line];
-    if (state->lines_num == 1) {
-        memset(line, 0, strlen(line));
-    } else {
-        free(line);
-        for (int i = state->line; i < state->lines_num; ++i)
-            state->lines[i] = state->lines[i + 1];
-
-        --state->lines_num;
-        state->line -= state->line > 0? 1 : 0;
-    }
-
-    state->cursor = 0;
-    state->dirty = true;
+    const char *name = strrchr(filename, '/');
+    name = name? name + 1 : filename;
+    snprintf(path, size, "%.*s.%s.led-undo", (int)(name - filename), filename, name);
 }
 
-void append_tab(LedState *state)
+// Maps the history saved alongside the file, if it still describes this version of it
+void undo_journal_open(UndoJournal *journal, const char *filename)
 {
-    for (int i = 0; i < 4; ++i)
-        append_char_cursor(state, ' ', true);
+    char path[PATH_MAX];
+    undo_sidecar_path(filename, path, sizeof(path));
 
-    state->dirty = true;
-}
+    struct stat file, sidecar;
+    if (stat(filename, &file) < 0)
+        return;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+
+    UndoSidecarHeader header;
+    bool valid = fstat(fd, &sidecar) == 0
+        && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, UNDO_SIDECAR_MAGIC, sizeof(header.magic)) == 0
+        && header.file_size == (uint64_t)file.st_size
+        && header.mtime_sec == file.st_mtim.tv_sec
+        && header.mtime_nsec == file.st_mtim.tv_nsec
+        && header.log_len > 0
+        && sizeof(header) + header.log_len <= (uint64_t)sidecar.st_size;
+    if (valid) {
+        uint64_t len = sizeof(header) + header.log_len;
+        void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            journal->map = map;
+            journal->map_len = len;
+            journal->disk = (unsigned char *)map + sizeof(header);
+            journal->disk_len = header.log_len;
+            journal->nodes[journal->current].sidecar = header.log_len;
+        }
+    }
+    close(fd);
+}
+
+// Brings the sidecar in line with the path to `target`, the state now on disk. Records
+// shared with the path saved last are kept; the rest is cut off and the new path appended.
+void undo_journal_persist(UndoJournal *journal, const char *filename, int64_t target, bool sync)
+{
+    char path[PATH_MAX];
+    undo_sidecar_path(filename, path, sizeof(path));
+
+    struct stat file;
+    if (stat(filename, &file) < 0)
+        return;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return;
+
+    // Mapped records sit above the root, so the cut never reaches into the mapping,
+    // which would fault when read past end of file
+    UndoNode *nodes = journal->nodes;
+    int64_t common = undo_journal_common(journal, journal->saved, target);
+    uint64_t keep = nodes[common].sidecar;
+
+    OpLog tail = { 0 };
+    int64_t len = nodes[target].depth - nodes[common].depth;
+    int64_t node = target;
+    for (int64_t i = 0; i < len; ++i, node = nodes[node].parent)
+        tail.len += nodes[node].record_len;
+    op_log_reserve(&tail, tail.len);
+
+    uint64_t end = keep + tail.len;
+    node = target;
+    for (int64_t i = 0; i < len; ++i, node = nodes[node].parent) {
+        nodes[node].sidecar = end;
+        end -= nodes[node].record_len;
+        memcpy(tail.data + end - keep, journal->records.data + nodes[node].record, nodes[node].record_len);
+    }
+
+    UndoSidecarHeader header = {
+        .magic = UNDO_SIDECAR_MAGIC,
+        .file_size = file.st_size,
+        .mtime_sec = file.st_mtim.tv_sec,
+        .mtime_nsec = file.st_mtim.tv_nsec,
+        .log_len = keep + tail.len,
+    };
+    bool written = ftruncate(fd, sizeof(header) + keep) == 0
+        && pwrite(fd, tail.data, tail.len, sizeof(header) + keep) == (ssize_t)tail.len
+        && (!sync || fsync(fd) == 0);
+    op_log_free(&tail);
+
+    // The header goes last, once the log is on disk; until then it names the
+    // previous version of the file
+    if (written && pwrite(fd, &header, sizeof(header), 0) == sizeof(header))
+        journal->saved = target;
+    close(fd);
+}
+
+int get_worker_count(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        return 1;
+
+    return n < MAX_WORKERS? n : MAX_WORKERS;
+}
+
+void *parallel_worker(void *arg)
+{
+    ParallelRun *run = arg;
+    int i;
+    while ((i = atomic_fetch_add(&run->next, 1)) < run->count)
+        run->job(run->ctx, i);
+
+    return NULL;
+}
+
+// Runs job(ctx, 0..count-1) across the worker threads and waits for all of them
+void parallel_for(int count, ParallelJob job, void *ctx)
+{
+    ParallelRun run = { .job = job, .ctx = ctx, .count = count };
+    atomic_init(&run.next, 0);
+
+    int workers = get_worker_count();
+    if (workers > count)
+        workers = count;
+
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    for (int i = 1; i < workers; ++i)
+        if (pthread_create(&threads[started], NULL, parallel_worker, &run) == 0)
+            ++started;
+
+    // The calling thread takes jobs too, so the loop finishes even if no thread starts
+    parallel_worker(&run);
+    for (int i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+}
+
+void line_starts_push(LineStarts *starts, uint64_t offset)
+{
+    if (starts->num >= starts->capacity) {
+        starts->capacity = starts->capacity? starts->capacity*2 : 64;
+        starts->offsets = realloc(starts->offsets, starts->capacity*sizeof(uint64_t));
+    }
+
+    starts->offsets[starts->num++] = offset;
+}
+
+uint64_t scan_newlines_scalar(const char *data, uint64_t from, uint64_t to, LineStarts *starts)
+{
+    if (from >= to)
+        return to;
+
+    const char *p = data + from, *end = data + to;
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        line_starts_push(starts, p - data + 1);
+        ++p;
+    }
+
+    return to;
+}
+
+#if SCAN_X86
+uint64_t scan_newlines_sse2(const char *data, uint64_t from, uint64_t to, LineStarts *starts)
+{
+    __m128i newline = _mm_set1_epi8('\n');
+    uint64_t i = from;
+    for (; i + 16 <= to; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        while (mask) {
+            line_starts_push(starts, i + __builtin_ctz(mask) + 1);
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_newlines_scalar(data, i, to, starts);
+}
+
+__attribute__((target("avx2")))
+uint64_t scan_newlines_avx2(const char *data, uint64_t from, uint64_t to, LineStarts *starts)
+{
+    __m256i newline = _mm256_set1_epi8('\n');
+    uint64_t i = from;
+    for (; i + 32 <= to; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline));
+        while (mask) {
+            line_starts_push(starts, i + __builtin_ctz(mask) + 1);
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_newlines_scalar(data, i, to, starts);
+}
+#endif
+
+// Appends the offset just past every '\n' in data[from, to) to starts
+void scan_newlines(const char *data, uint64_t from, uint64_t to, LineStarts *starts)
+{
+#if SCAN_X86
+    // libgcc probes the CPU once before main, so this only reads the result and
+    // is safe from the worker threads
+    if (__builtin_cpu_supports("avx2"))
+        scan_newlines_avx2(data, from, to, starts);
+    else
+        scan_newlines_sse2(data, from, to, starts);
+#else
+    scan_newlines_scalar(data, from, to, starts);
+#endif
+}
+
+void scan_newlines_job(void *ctx, int i)
+{
+    NewlineScan *scan = ctx;
+    uint64_t from = scan->from + i*scan->chunk_size;
+    uint64_t to = from + scan->chunk_size < scan->to? from + scan->chunk_size : scan->to;
+    scan_newlines(scan->data, from, to, &scan->chunks[i]);
+}
+
+// Large ranges are split into chunks that are scanned in parallel and then merged
+void scan_newlines_parallel(const char *data, uint64_t from, uint64_t to, LineStarts *starts)
+{
+    int chunks_num = (to - from + SCAN_CHUNK_SIZE - 1)/SCAN_CHUNK_SIZE;
+    if (chunks_num < 2 || get_worker_count() < 2) {
+        scan_newlines(data, from, to, starts);
+        return;
+    }
+
+    NewlineScan scan = {
+        .data = data,
+        .from = from,
+        .to = to,
+        .chunk_size = SCAN_CHUNK_SIZE,
+        .chunks = calloc(chunks_num, sizeof(LineStarts)),
+    };
+    parallel_for(chunks_num, scan_newlines_job, &scan);
+
+    uint64_t total = starts->num;
+    for (int i = 0; i < chunks_num; ++i)
+        total += scan.chunks[i].num;
+
+    if (total > starts->capacity) {
+        starts->capacity = total;
+        starts->offsets = realloc(starts->offsets, total*sizeof(uint64_t));
+    }
+
+    for (int i = 0; i < chunks_num; ++i) {
+        memcpy(starts->offsets + starts->num, scan.chunks[i].offsets, scan.chunks[i].num*sizeof(uint64_t));
+        starts->num += scan.chunks[i].num;
+        free(scan.chunks[i].offsets);
+    }
+    free(scan.chunks);
+}
+
+uint64_t find_bytes_scalar(const char *haystack, uint64_t len, const char *needle, uint64_t needle_len)
+{
+    const char *match = memmem(haystack, len, needle, needle_len);
+    return match? (uint64_t)(match - haystack) : FIND_NONE;
+}
+
+#if SCAN_X86
+// Candidates are positions where both the first and the last byte of the needle
+// line up; only those are compared in full
+uint64_t find_bytes_sse2(const char *haystack, uint64_t len, const char *needle, uint64_t needle_len)
+{
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    uint64_t i = 0;
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i head = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i tail = _mm_loadu_si128((const __m128i *)(haystack + i + needle_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+        while (mask) {
+            uint64_t at = i + __builtin_ctz(mask);
+            if (memcmp(haystack + at, needle, needle_len) == 0)
+                return at;
+            mask &= mask - 1;
+        }
+    }
+
+    uint64_t rest = find_bytes_scalar(haystack + i, len - i, needle, needle_len);
+    return rest == FIND_NONE? FIND_NONE : i + rest;
+}
+
+__attribute__((target("avx2")))
+uint64_t find_bytes_avx2(const char *haystack, uint64_t len, const char *needle, uint64_t needle_len)
+{
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+    uint64_t i = 0;
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        __m256i head = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i tail = _mm256_loadu_si256((const __m256i *)(haystack + i + needle_len - 1));
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+        while (mask) {
+            uint64_t at = i + __builtin_ctz(mask);
+            if (memcmp(haystack + at, needle, needle_len) == 0)
+                return at;
+            mask &= mask - 1;
+        }
+    }
+
+    uint64_t rest = find_bytes_scalar(haystack + i, len - i, needle, needle_len);
+    return rest == FIND_NONE? FIND_NONE : i + rest;
+}
+#endif
+
+// Offset of the first occurrence of needle in haystack, or FIND_NONE
+uint64_t find_bytes(const char *haystack, uint64_t len, const char *needle, uint64_t needle_len)
+{
+    if (needle_len == 0 || len < needle_len)
+        return FIND_NONE;
+
+#if SCAN_X86
+    if (__builtin_cpu_supports("avx2"))
+        return find_bytes_avx2(haystack, len, needle, needle_len);
+    else
+        return find_bytes_sse2(haystack, len, needle, needle_len);
+#else
+    return find_bytes_scalar(haystack, len, needle, needle_len);
+#endif
+}
+
+uint32_t trigram_hash(const char *p)
+{
+    uint32_t trigram = (unsigned char)p[0] | (unsigned char)p[1] << 8 | (unsigned char)p[2] << 16;
+    return (trigram*2654435761u) >> (32 - TRIGRAM_HASH_BITS);
+}
+
+// Sets the bits of the trigrams starting in [from, to) of data
+void trigram_signature(uint64_t *bits, const char *data, uint64_t from, uint64_t to)
+{
+    for (uint64_t i = from; i < to; ++i) {
+        uint32_t hash = trigram_hash(data + i);
+        bits[hash/64] |= (uint64_t)1 << (hash%64);
+    }
+}
+
+// Indexes len bytes of data in the background; blocks become usable in order
+void trigram_index_start(TrigramIndex *index, const char *data, uint64_t len)
+{
+    *index = (TrigramIndex){
+        .blocks = (len + TRIGRAM_BLOCK_SIZE - 1)/TRIGRAM_BLOCK_SIZE,
+        .data = data,
+        .len = len,
+    };
+    index->bits = calloc(index->blocks*TRIGRAM_WORDS, sizeof(uint64_t));
+    atomic_init(&index->ready, 0);
+    atomic_init(&index->cancel, false);
+
+    index->running = true;
+    if (pthread_create(&index->thread, NULL, trigram_index_thread, index) != 0) {
+        trigram_index_thread(index);
+        index->thread = pthread_self();
+    }
+}
+
+void *trigram_index_thread(void *arg)
+{
+    TrigramIndex *index = arg;
+    uint64_t step = (uint64_t)TRIGRAM_GROUP*get_worker_count();
+    for (uint64_t first = 0; first < index->blocks && !atomic_load(&index->cancel); first += step) {
+        uint64_t count = index->blocks - first < step? index->blocks - first : step;
+        TrigramGroup group = { index, first };
+        parallel_for(count, trigram_index_block, &group);
+        atomic_store(&index->ready, first + count);
+    }
+
+    return NULL;
+}
+
+void trigram_index_block(void *arg, int i)
+{
+    TrigramGroup *group = arg;
+    TrigramIndex *index = group->index;
+    if (index->len < 3)
+        return;
+
+    uint64_t block = group->first + i;
+    uint64_t from = block*TRIGRAM_BLOCK_SIZE;
+    uint64_t to = from + TRIGRAM_BLOCK_SIZE + FIND_QUERY_MAX;
+    if (to > index->len - 2)
+        to = index->len - 2;
+    trigram_signature(index->bits + block*TRIGRAM_WORDS, index->data, from, to);
+}
+
+// Takes in text appended to the source from `from` on; the trigrams that now
+// end in it start up to two bytes earlier
+void trigram_index_append(TrigramIndex *index, const char *data, uint64_t from, uint64_t len)
+{
+    uint64_t blocks = (len + TRIGRAM_BLOCK_SIZE - 1)/TRIGRAM_BLOCK_SIZE;
+    if (blocks > index->blocks) {
+        index->bits = realloc(index->bits, blocks*TRIGRAM_WORDS*sizeof(uint64_t));
+        memset(index->bits + index->blocks*TRIGRAM_WORDS, 0, (blocks - index->blocks)*TRIGRAM_WORDS*sizeof(uint64_t));
+        index->blocks = blocks;
+    }
+
+    for (uint64_t i = from > 2? from - 2 : 0; i + 2 < len; ++i) {
+        uint32_t hash = trigram_hash(data + i);
+        uint64_t block = i/TRIGRAM_BLOCK_SIZE;
+        index->bits[block*TRIGRAM_WORDS + hash/64] |= (uint64_t)1 << (hash%64);
+        if (block > 0 && i%TRIGRAM_BLOCK_SIZE < FIND_QUERY_MAX)
+            index->bits[(block - 1)*TRIGRAM_WORDS + hash/64] |= (uint64_t)1 << (hash%64);
+    }
+    atomic_store(&index->ready, blocks);
+}
+
+// Whether a match can start in the block; blocks not indexed yet always can
+bool trigram_index_may_match(TrigramIndex *index, uint64_t block, const uint64_t *mask)
+{
+    if (block >= atomic_load(&index->ready))
+        return true;
+
+    const uint64_t *bits = index->bits + block*TRIGRAM_WORDS;
+    for (int i = 0; i < TRIGRAM_WORDS; ++i)
+        if ((bits[i] & mask[i]) != mask[i])
+            return false;
+
+    return true;
+}
+
+void trigram_index_free(TrigramIndex *index)
+{
+    if (index->running) {
+        atomic_store(&index->cancel, true);
+        if (!pthread_equal(index->thread, pthread_self()))
+            pthread_join(index->thread, NULL);
+    }
+
+    free(index->bits);
+    *index = (TrigramIndex){ 0 };
+}
+
+// Records the line starts of everything in the buffer past offset `from`
+void text_buffer_index_lines(TextBuffer *buffer, uint64_t from)
+{
+    scan_newlines_parallel(buffer->data, from, buffer->len, &buffer->lines);
+}
+
+void text_buffer_append(TextBuffer *buffer, const char *text, uint64_t len)
+{
+    if (buffer->len + len > buffer->capacity) {
+        uint64_t capacity = buffer->capacity? buffer->capacity : ADD_BUFFER_INIT;
+        while (capacity < buffer->len + len)
+            capacity *= 2;
+
+        if (buffer->pins > 0) {
+            char *data = malloc(capacity);
+            memcpy(data, buffer->data, buffer->len);
+            buffer->retired = realloc(buffer->retired, (buffer->retired_num + 1)*sizeof(char *));
+            buffer->retired[buffer->retired_num++] = buffer->data;
+            buffer->data = data;
+        } else {
+            buffer->data = realloc(buffer->data, capacity);
+        }
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->len, text, len);
+    buffer->len += len;
+    text_buffer_index_lines(buffer, buffer->len - len);
+    trigram_index_append(&buffer->trigrams, buffer->data, buffer->len - len, buffer->len);
+}
+
+// Index of the first line start that is >= offset
+uint64_t text_buffer_lower_bound(TextBuffer *buffer, uint64_t offset)
+{
+    uint64_t lo = 0, hi = buffer->lines.num;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo)/2;
+        if (buffer->lines.offsets[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+uint64_t text_buffer_count_newlines(TextBuffer *buffer, uint64_t start, uint64_t len)
+{
+    return text_buffer_lower_bound(buffer, start + len + 1) - text_buffer_lower_bound(buffer, start + 1);
+}
+
+// Frees the blocks that were outgrown while a reader held on to them
+void text_buffer_pin(TextBuffer *buffer)
+{
+    ++buffer->pins;
+}
+
+void text_buffer_unpin(TextBuffer *buffer)
+{
+    if (buffer->pins > 0 && --buffer->pins > 0)
+        return;
+
+    for (int i = 0; i < buffer->retired_num; ++i)
+        free(buffer->retired[i]);
+    free(buffer->retired);
+    buffer->retired = NULL;
+    buffer->retired_num = 0;
+}
+
+void text_buffer_free(TextBuffer *buffer)
+{
+    trigram_index_free(&buffer->trigrams);
+    buffer->pins = 0;
+    text_buffer_unpin(buffer);
+    if (buffer->fd >= 0)
+        close(buffer->fd);
+    if (buffer->mapped)
+        munmap(buffer->data, buffer->capacity);
+    else
+        free(buffer->data);
+    free(buffer->lines.offsets);
+    *buffer = (TextBuffer){ 0 };
+}
+
+Piece piece_slice(PieceTable *table, Piece piece, uint64_t from, uint64_t len)
+{
+    piece.start += from;
+    piece.len = len;
+    piece.newlines = text_buffer_count_newlines(&table->sources[piece.source], piece.start, len);
+    return piece;
+}
+
+PieceNode *piece_node_new(bool leaf)
+{
+    PieceNode *node = calloc(1, sizeof(PieceNode));
+    node->refs = 1;
+    node->leaf = leaf;
+    return node;
+}
+
+PieceNode *piece_node_ref(PieceNode *node)
+{
+    ++node->refs;
+    return node;
+}
+
+// Returns a node that can be changed in place: the node itself when nothing else
+// holds it, otherwise a copy sharing its children
+PieceNode *piece_node_own(PieceNode *node)
+{
+    if (node->refs == 1)
+        return node;
+
+    PieceNode *copy = malloc(sizeof(PieceNode));
+    *copy = *node;
+    copy->refs = 1;
+    if (!copy->leaf)
+        for (int i = 0; i < copy->count; ++i)
+            piece_node_ref(copy->children[i]);
+
+    --node->refs;
+    return copy;
+}
+
+// Drops a reference; the node and whatever only it held go with the last one
+void piece_node_free(PieceNode *node)
+{
+    if (--node->refs > 0)
+        return;
+
+    if (!node->leaf)
+        for (int i = 0; i < node->count; ++i)
+            piece_node_free(node->children[i]);
+
+    free(node);
+}
+
+void piece_node_sum(PieceNode *node, uint64_t *bytes, uint64_t *newlines)
+{
+    *bytes = 0;
+    *newlines = 0;
+    for (int i = 0; i < node->count; ++i) {
+        *bytes += node->bytes[i];
+        *newlines += node->newlines[i];
+    }
+}
+
+// Makes room for `count` slots at index `at`
+void piece_node_open(PieceNode *node, int at, int count)
+{
+    int tail = node->count - at;
+    memmove(node->bytes + at + count, node->bytes + at, tail*sizeof(uint64_t));
+    memmove(node->newlines + at + count, node->newlines + at, tail*sizeof(uint64_t));
+    if (node->leaf)
+        memmove(node->pieces + at + count, node->pieces + at, tail*sizeof(Piece));
+    else
+        memmove(node->children + at + count, node->children + at, tail*sizeof(PieceNode *));
+
+    node->count += count;
+}
+
+void piece_node_close(PieceNode *node, int at, int count)
+{
+    int tail = node->count - at - count;
+    memmove(node->bytes + at, node->bytes + at + count, tail*sizeof(uint64_t));
+    memmove(node->newlines + at, node->newlines + at + count, tail*sizeof(uint64_t));
+    if (node->leaf)
+        memmove(node->pieces + at, node->pieces + at + count, tail*sizeof(Piece));
+    else
+        memmove(node->children + at, node->children + at + count, tail*sizeof(PieceNode *));
+
+    node->count -= count;
+}
+
+void piece_node_set_piece(PieceNode *node, int at, Piece piece)
+{
+    node->pieces[at] = piece;
+    node->bytes[at] = piece.len;
+    node->newlines[at] = piece.newlines;
+}
+
+void piece_node_set_child(PieceNode *node, int at, PieceNode *child)
+{
+    node->children[at] = child;
+    piece_node_sum(child, &node->bytes[at], &node->newlines[at]);
+}
+
+// Moves the upper half of an overflowing node into a new right sibling
+PieceNode *piece_node_split(PieceNode *node)
+{
+    if (node->count <= PIECE_NODE_MAX)
+        return NULL;
+
+    PieceNode *right = piece_node_new(node->leaf);
+    int half = node->count/2;
+    right->count = node->count - half;
+
+    memcpy(right->bytes, node->bytes + half, right->count*sizeof(uint64_t));
+    memcpy(right->newlines, node->newlines + half, right->count*sizeof(uint64_t));
+    if (node->leaf)
+        memcpy(right->pieces, node->pieces + half, right->count*sizeof(Piece));
+    else
+        memcpy(right->children, node->children + half, right->count*sizeof(PieceNode *));
+
+    node->count = half;
+    return right;
+}
+
+// Folds underfull children into their right neighbour while they fit
+void piece_node_rebalance(PieceNode *node)
+{
+    for (int i = node->count - 2; i >= 0; --i) {
+        PieceNode *left = node->children[i];
+        PieceNode *right = node->children[i + 1];
+        if (left->count >= PIECE_NODE_MIN && right->count >= PIECE_NODE_MIN)
+            continue;
+        if (left->count + right->count > PIECE_NODE_MAX)
+            continue;
+
+        left = node->children[i] = piece_node_own(left);
+        right = node->children[i + 1] = piece_node_own(right);
+        memcpy(left->bytes + left->count, right->bytes, right->count*sizeof(uint64_t));
+        memcpy(left->newlines + left->count, right->newlines, right->count*sizeof(uint64_t));
+        if (left->leaf)
+            memcpy(left->pieces + left->count, right->pieces, right->count*sizeof(Piece));
+        else
+            memcpy(left->children + left->count, right->children, right->count*sizeof(PieceNode *));
+        left->count += right->count;
+
+        free(right);
+        piece_node_close(node, i + 1, 1);
+        piece_node_set_child(node, i, left);
+    }
+}
+
+PieceNode *piece_node_insert(PieceTable *table, PieceNode *node, uint64_t offset, Piece piece)
+{
+    // Boundaries resolve to the left so typing lands at the end of the previous piece
+    int i = 0;
+    while (i < node->count - 1 && offset > node->bytes[i])
+        offset -= node->bytes[i++];
+
+    if (!node->leaf) {
+        node->children[i] = piece_node_own(node->children[i]);
+        PieceNode *split = piece_node_insert(table, node->children[i], offset, piece);
+        piece_node_set_child(node, i, node->children[i]);
+        if (split) {
+            piece_node_open(node, i + 1, 1);
+            piece_node_set_child(node, i + 1, split);
+        }
+
+        return piece_node_split(node);
+    }
+
+    if (node->count == 0) {
+        piece_node_open(node, 0, 1);
+        piece_node_set_piece(node, 0, piece);
+        return NULL;
+    }
+
+    Piece *prev = &node->pieces[i];
+    if (offset == prev->len) {
+        if (prev->source == piece.source && prev->start + prev->len == piece.start) {
+            piece.start = prev->start;
+            piece.len += prev->len;
+            piece.newlines += prev->newlines;
+            piece_node_set_piece(node, i, piece);
+            return NULL;
+        }
+
+        piece_node_open(node, i + 1, 1);
+        piece_node_set_piece(node, i + 1, piece);
+    } else if (offset == 0) {
+        piece_node_open(node, i, 1);
+        piece_node_set_piece(node, i, piece);
+    } else {
+        Piece left = piece_slice(table, *prev, 0, offset);
+        Piece right = piece_slice(table, *prev, offset, prev->len - offset);
+
+        piece_node_open(node, i + 1, 2);
+        piece_node_set_piece(node, i, left);
+        piece_node_set_piece(node, i + 1, piece);
+        piece_node_set_piece(node, i + 2, right);
+    }
+
+    return piece_node_split(node);
+}
+
+PieceNode *piece_node_delete(PieceTable *table, PieceNode *node, uint64_t offset, uint64_t len)
+{
+    uint64_t starts[PIECE_NODE_MAX + 2];
+    uint64_t start = 0;
+    for (int i = 0; i < node->count; ++i) {
+        starts[i] = start;
+        start += node->bytes[i];
+    }
+
+    // Walk backwards so slots that are split or removed don't shift the ones left to visit
+    uint64_t end = offset + len;
+    for (int i = node->count - 1; i >= 0; --i) {
+        uint64_t slot_start = starts[i];
+        uint64_t slot_end = slot_start + node->bytes[i];
+        if (slot_end <= offset || slot_start >= end)
+            continue;
+
+        uint64_t from = (offset > slot_start? offset : slot_start) - slot_start;
+        uint64_t to = (end < slot_end? end : slot_end) - slot_start;
+
+        if (!node->leaf) {
+            PieceNode *child = node->children[i] = piece_node_own(node->children[i]);
+            PieceNode *split = piece_node_delete(table, child, from, to - from);
+            if (child->count == 0) {
+                piece_node_free(child);
+                piece_node_close(node, i, 1);
+                continue;
+            }
+
+            piece_node_set_child(node, i, child);
+            if (split) {
+                piece_node_open(node, i + 1, 1);
+                piece_node_set_child(node, i + 1, split);
+            }
+            continue;
+        }
+
+        Piece piece = node->pieces[i];
+        if (from == 0 && to == piece.len) {
+            piece_node_close(node, i, 1);
+        } else if (from == 0) {
+            piece_node_set_piece(node, i, piece_slice(table, piece, to, piece.len - to));
+        } else if (to == piece.len) {
+            piece_node_set_piece(node, i, piece_slice(table, piece, 0, from));
+        } else {
+            piece_node_open(node, i + 1, 1);
+            piece_node_set_piece(node, i, piece_slice(table, piece, 0, from));
+            piece_node_set_piece(node, i + 1, piece_slice(table, piece, to, piece.len - to));
+        }
+    }
+
+    if (!node->leaf)
+        piece_node_rebalance(node);
+
+    return piece_node_split(node);
+}
+
+// Writes out the queued pieces, picking up after short writes
+void piece_writer_flush(PieceWriter *writer)
+{
+    struct iovec *iov = writer->iov;
+    int count = writer->count;
+    writer->count = 0;
+
+    while (count > 0 && !writer->failed) {
+        ssize_t n = writev(writer->fd, iov, count);
+        if (n < 0) {
+            writer->failed = errno != EINTR;
+            continue;
+        }
+
+        if (writer->written)
+            atomic_fetch_add(writer->written, n);
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+// Copies an original piece without it passing through user space. Filesystems
+// that can't do this get the piece queued for writev like any other.
+void piece_writer_splice(PieceWriter *writer, Piece *piece)
+{
+    piece_writer_flush(writer);
+
+    loff_t offset = piece->start;
+    uint64_t left = piece->len;
+    while (left > 0 && !writer->failed) {
+        ssize_t n = copy_file_range(writer->splice_fd, &offset, writer->fd, NULL, left, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP) {
+                writer->failed = true;
+                return;
+            }
+
+            writer->splice_fd = -1;
+            writer->iov[writer->count++] = (struct iovec){
+                .iov_base = (char *)writer->sources[piece->source] + offset,
+                .iov_len = left,
+            };
+            return;
+        }
+
+        left -= n;
+        if (writer->written)
+            atomic_fetch_add(writer->written, n);
+    }
+}
+
+void piece_node_write(PieceWriter *writer, PieceNode *node)
+{
+    for (int i = 0; i < node->count && !writer->failed; ++i) {
+        if (!node->leaf) {
+            piece_node_write(writer, node->children[i]);
+            continue;
+        }
+
+        if (writer->count == SAVE_IOV_MAX)
+            piece_writer_flush(writer);
+
+        Piece *piece = &node->pieces[i];
+        if (piece->source == PIECE_SOURCE_ORIGINAL && writer->splice_fd >= 0 && piece->len >= SAVE_SPLICE_MIN) {
+            piece_writer_splice(writer, piece);
+            continue;
+        }
+
+        writer->iov[writer->count++] = (struct iovec){
+            .iov_base = (char *)writer->sources[piece->source] + piece->start,
+            .iov_len = piece->len,
+        };
+    }
+}
+
+// Grows the tree on a root split and drops levels that only have one child
+void piece_table_set_root(PieceTable *table, PieceNode *split)
+{
+    if (split) {
+        PieceNode *root = piece_node_new(false);
+        root->count = 2;
+        piece_node_set_child(root, 0, table->root);
+        piece_node_set_child(root, 1, split);
+        table->root = root;
+    }
+
+    while (!table->root->leaf && table->root->count <= 1) {
+        PieceNode *root = piece_node_own(table->root);
+        table->root = root->count? root->children[0] : piece_node_new(true);
+        free(root);
+    }
+
+    piece_node_sum(table->root, &table->len, &table->newlines);
+}
+
+// Takes ownership of text, which is unmapped rather than freed when `mapped` is set
+void piece_table_init(PieceTable *table, char *text, uint64_t len, bool mapped)
+{
+    *table = (PieceTable){ 0 };
+    table->root = piece_node_new(true);
+
+    TextBuffer *original = &table->sources[PIECE_SOURCE_ORIGINAL];
+    original->data = text;
+    original->len = len;
+    original->capacity = len;
+    original->mapped = mapped;
+    original->fd = -1;
+    table->sources[PIECE_SOURCE_ADD].fd = -1;
+    text_buffer_index_lines(original, 0);
+
+    if (len > 0) {
+        Piece piece = { PIECE_SOURCE_ORIGINAL, 0, len, original->lines.num };
+        piece_table_set_root(table, piece_node_insert(table, table->root, 0, piece));
+    }
+
+    // Every line is terminated, so the text always ends in a newline
+    if (len == 0 || text[len - 1] != '\n')
+        piece_table_insert(table, table->len, "\n", 1);
+}
+
+// Adds the next stretch of a file that is still being indexed at the end of the
+// text, taking over its line starts. The original source grows up to `to`.
+void piece_table_extend(PieceTable *table, uint64_t to, LineStarts *lines)
+{
+    TextBuffer *original = &table->sources[PIECE_SOURCE_ORIGINAL];
+    LineStarts *starts = &original->lines;
+    if (starts->num + lines->num > starts->capacity) {
+        starts->capacity = starts->num + lines->num;
+        starts->offsets = realloc(starts->offsets, starts->capacity*sizeof(uint64_t));
+    }
+    if (lines->num)
+        memcpy(starts->offsets + starts->num, lines->offsets, lines->num*sizeof(uint64_t));
+    starts->num += lines->num;
+
+    Piece piece = { PIECE_SOURCE_ORIGINAL, original->len, to - original->len, lines->num };
+    original->len = to;
+    table->root = piece_node_own(table->root);
+    piece_table_set_root(table, piece_node_insert(table, table->root, table->len, piece));
+}
+
+void piece_table_free(PieceTable *table)
+{
+    text_buffer_free(&table->sources[PIECE_SOURCE_ORIGINAL]);
+    text_buffer_free(&table->sources[PIECE_SOURCE_ADD]);
+    piece_node_free(table->root);
+    *table = (PieceTable){ 0 };
+}
+
+void piece_table_insert(PieceTable *table, uint64_t offset, const char *text, uint64_t len)
+{
+    if (len == 0)
+        return;
+
+    TextBuffer *add = &table->sources[PIECE_SOURCE_ADD];
+    uint64_t start = add->len;
+    text_buffer_append(add, text, len);
+
+    Piece piece = { PIECE_SOURCE_ADD, start, len, text_buffer_count_newlines(add, start, len) };
+    table->root = piece_node_own(table->root);
+    piece_table_set_root(table, piece_node_insert(table, table->root, offset, piece));
+}
+
+void piece_table_delete(PieceTable *table, uint64_t offset, uint64_t len)
+{
+    if (offset >= table->len || len == 0)
+        return;
+    if (len > table->len - offset)
+        len = table->len - offset;
+
+    table->root = piece_node_own(table->root);
+    piece_table_set_root(table, piece_node_delete(table, table->root, offset, len));
+}
+
+// Finds the piece holding offset, and where in that piece offset falls
+Piece *piece_table_locate(PieceTable *table, uint64_t offset, uint64_t *from)
+{
+    if (offset >= table->len)
+        return NULL;
+
+    PieceNode *node = table->root;
+    for (;;) {
+        int i = 0;
+        while (offset >= node->bytes[i])
+            offset -= node->bytes[i++];
+
+        if (node->leaf) {
+            *from = offset;
+            return &node->pieces[i];
+        }
+        node = node->children[i];
+    }
+}
+
+uint64_t piece_table_read(PieceTable *table, uint64_t offset, uint64_t len, char *dst)
+{
+    uint64_t read = 0;
+    while (read < len) {
+        uint64_t from;
+        Piece *piece = piece_table_locate(table, offset + read, &from);
+        if (!piece)
+            break;
+
+        uint64_t n = piece->len - from;
+        if (n > len - read)
+            n = len - read;
+
+        memcpy(dst + read, table->sources[piece->source].data + piece->start + from, n);
+        read += n;
+    }
+
+    return read;
+}
+
+// Reads the lines that start in [from, to) into a new NUL-terminated string,
+// from a byte early, to see whether a line starts right at `from`, on to the end
+// of the last one. The text starts at offset *start and the lines span
+// [*begin, *end) of it. Only the tree is used, so this is safe on a snapshot.
+char *piece_table_read_lines(PieceTable *table, uint64_t from, uint64_t to, uint64_t *start, uint64_t *begin, uint64_t *end)
+{
+    *start = from > 0? from - 1 : 0;
+    uint64_t capacity = to - *start + SEARCH_LINE_READ;
+    char *text = malloc(capacity + 1);
+    uint64_t len = piece_table_read(table, *start, to - *start, text);
+    while (text[len - 1] != '\n' && *start + len < table->len) {
+        if (len + SEARCH_LINE_READ > capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity + 1);
+        }
+        len += piece_table_read(table, *start + len, SEARCH_LINE_READ, text + len);
+    }
+    text[len] = '\0';
+
+    *begin = 0;
+    if (from > 0) {
+        const char *newline = memchr(text, '\n', to - *start - 1);
+        *begin = newline? (uint64_t)(newline - text) + 1 : len;
+    }
+    const char *last = memchr(text + (to - *start - 1), '\n', len - (to - *start - 1));
+    *end = last? (uint64_t)(last - text) + 1 : len;
+    return text;
+}
+
+uint64_t piece_table_line_start(PieceTable *table, uint64_t line)
+{
+    if (line == 0)
+        return 0;
+    if (line > table->newlines)
+        return table->len;
+
+    // Descend to the piece holding the newline that ends line - 1
+    PieceNode *node = table->root;
+    uint64_t offset = 0;
+    for (;;) {
+        int i = 0;
+        while (line > node->newlines[i]) {
+            line -= node->newlines[i];
+            offset += node->bytes[i++];
+        }
+
+        if (node->leaf) {
+            Piece *piece = &node->pieces[i];
+            TextBuffer *source = &table->sources[piece->source];
+            uint64_t index = text_buffer_lower_bound(source, piece->start + 1) + line - 1;
+            return offset + source->lines.offsets[index] - piece->start;
+        }
+        node = node->children[i];
+    }
+}
+
+uint64_t piece_table_line_length(PieceTable *table, uint64_t line)
+{
+    uint64_t start = piece_table_line_start(table, line);
+    uint64_t end = piece_table_line_start(table, line + 1);
+    return end > start? end - start - 1 : 0;
+}
+
+// Number of the line that offset falls on
+uint64_t piece_table_offset_line(PieceTable *table, uint64_t offset)
+{
+    if (offset >= table->len)
+        return table->newlines;
+
+    PieceNode *node = table->root;
+    uint64_t line = 0;
+    for (;;) {
+        int i = 0;
+        while (offset >= node->bytes[i]) {
+            offset -= node->bytes[i];
+            line += node->newlines[i++];
+        }
+
+        if (node->leaf) {
+            Piece *piece = &node->pieces[i];
+            return line + text_buffer_count_newlines(&table->sources[piece->source], piece->start, offset);
+        }
+        node = node->children[i];
+    }
+}
+
+// Walks the pieces in order from search->from, searching each one where it lies
+// in its source. Returns true once a match has been found.
+bool piece_node_find(PieceSearch *search, PieceNode *node, uint64_t base)
+{
+    for (int i = 0; i < node->count; ++i, base += node->bytes[i - 1]) {
+        uint64_t end = base + node->bytes[i];
+        if (end <= search->from)
+            continue;
+
+        if (!node->leaf) {
+            if (piece_node_find(search, node->children[i], base))
+                return true;
+            continue;
+        }
+
+        Piece *piece = &node->pieces[i];
+        uint64_t skip = search->from > base? search->from - base : 0;
+        uint64_t at = piece_find(search, piece, skip);
+        if (at != FIND_NONE) {
+            search->found = base + at;
+            return true;
+        }
+
+        // Anything found around the boundary now has to cross it
+        if (search->len < 2 || end >= search->table->len)
+            continue;
+
+        char window[2*FIND_QUERY_MAX];
+        uint64_t from = end - (search->len - 1) > search->from? end - (search->len - 1) : search->from;
+        uint64_t to = end + search->len - 1 < search->table->len? end + search->len - 1 : search->table->len;
+        piece_table_read(search->table, from, to - from, window);
+        at = find_bytes(window, to - from, search->needle, search->len);
+        if (at != FIND_NONE) {
+            search->found = from + at;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Searches a piece from `skip` on, only in the runs of blocks of its source
+// whose trigram signatures hold every trigram of the needle
+uint64_t piece_find(PieceSearch *search, Piece *piece, uint64_t skip)
+{
+    TextBuffer *source = &search->table->sources[piece->source];
+    uint64_t from = piece->start + skip, end = piece->start + piece->len;
+    if (search->len < 3) {
+        uint64_t at = find_bytes(source->data + from, end - from, search->needle, search->len);
+        return at == FIND_NONE? FIND_NONE : skip + at;
+    }
+
+    while (from < end) {
+        uint64_t block = from/TRIGRAM_BLOCK_SIZE;
+        if (!trigram_index_may_match(&source->trigrams, block, search->mask)) {
+            from = (block + 1)*TRIGRAM_BLOCK_SIZE;
+            continue;
+        }
+
+        // Matches may start anywhere up to the end of the run
+        uint64_t run = block + 1;
+        while (run*TRIGRAM_BLOCK_SIZE < end && trigram_index_may_match(&source->trigrams, run, search->mask))
+            ++run;
+        uint64_t to = run*TRIGRAM_BLOCK_SIZE < end? run*TRIGRAM_BLOCK_SIZE : end;
+        uint64_t limit = to + search->len - 1 < end? to + search->len - 1 : end;
+
+        uint64_t at = find_bytes(source->data + from, limit - from, search->needle, search->len);
+        if (at != FIND_NONE)
+            return from + at - piece->start;
+        from = to;
+    }
+
+    return FIND_NONE;
+}
+
+void piece_search_init(PieceSearch *search, PieceTable *table, const char *needle, uint64_t len, uint64_t from)
+{
+    *search = (PieceSearch){
+        .table = table,
+        .needle = needle,
+        .len = len,
+        .from = from,
+        .found = FIND_NONE,
+    };
+    for (uint64_t i = 0; i + 2 < len; ++i) {
+        uint32_t hash = trigram_hash(needle + i);
+        search->mask[hash/64] |= (uint64_t)1 << (hash%64);
+    }
+}
+
+// Offset of the first match at or after `from`, or FIND_NONE
+uint64_t piece_table_find(PieceTable *table, const char *needle, uint64_t len, uint64_t from)
+{
+    PieceSearch search;
+    piece_search_init(&search, table, needle, len, from);
+    if (len > 0 && len <= FIND_QUERY_MAX)
+        piece_node_find(&search, table->root, 0);
+
+    return search.found;
+}
+
+// Counts the matches lying within the piece that start at [skip, limit) of it,
+// overlapping ones too, in the runs of blocks the trigram filter lets through
+void piece_count(PieceSearch *search, Piece *piece, uint64_t base, uint64_t skip, uint64_t limit)
+{
+    TextBuffer *source = &search->table->sources[piece->source];
+    uint64_t from = piece->start + skip, last = piece->start + limit, end = piece->start + piece->len;
+    while (from < last) {
+        uint64_t to = last;
+        if (search->len >= 3) {
+            uint64_t block = from/TRIGRAM_BLOCK_SIZE;
+            if (!trigram_index_may_match(&source->trigrams, block, search->mask)) {
+                from = (block + 1)*TRIGRAM_BLOCK_SIZE;
+                continue;
+            }
+
+            uint64_t run = block + 1;
+            while (run*TRIGRAM_BLOCK_SIZE < last && trigram_index_may_match(&source->trigrams, run, search->mask))
+                ++run;
+            if (run*TRIGRAM_BLOCK_SIZE < last)
+                to = run*TRIGRAM_BLOCK_SIZE;
+        }
+
+        uint64_t bound = to + search->len - 1 < end? to + search->len - 1 : end;
+        for (uint64_t at = from; at < to; ++at) {
+            uint64_t match = find_bytes(source->data + at, bound - at, search->needle, search->len);
+            if (match == FIND_NONE || at + match >= to)
+                break;
+
+            at += match;
+            ++search->count;
+            search->preceding += base + at - piece->start < search->before;
+        }
+        from = to;
+    }
+}
+
+void piece_node_count(PieceSearch *search, PieceNode *node, uint64_t base)
+{
+    for (int i = 0; i < node->count && base < search->to; base += node->bytes[i++]) {
+        uint64_t end = base + node->bytes[i];
+        if (end <= search->from)
+            continue;
+
+        if (!node->leaf) {
+            piece_node_count(search, node->children[i], base);
+            continue;
+        }
+
+        Piece *piece = &node->pieces[i];
+        uint64_t skip = search->from > base? search->from - base : 0;
+        uint64_t limit = search->to < end? search->to - base : piece->len;
+        piece_count(search, piece, base, skip, limit);
+
+        // Matches crossing the end of the piece are counted by the piece they start in
+        if (search->len < 2 || end >= search->table->len)
+            continue;
+
+        uint64_t from = end - (search->len - 1);
+        if (from < base)
+            from = base;
+        if (from < search->from)
+            from = search->from;
+        uint64_t last = end < search->to? end : search->to;
+        if (from >= last)
+            continue;
+
+        char window[2*FIND_QUERY_MAX];
+        uint64_t to = end + search->len - 1 < search->table->len? end + search->len - 1 : search->table->len;
+        uint64_t len = piece_table_read(search->table, from, to - from, window);
+        for (uint64_t at = 0; from + at < last; ++at) {
+            uint64_t match = find_bytes(window + at, len - at, search->needle, search->len);
+            if (match == FIND_NONE || from + at + match >= last)
+                break;
+
+            at += match;
+            ++search->count;
+            search->preceding += from + at < search->before;
+        }
+    }
+}
+
+// Occurrences of needle starting in [from, to), overlapping ones too, as Enter
+// visits them all. With `preceding`, also how many start before `before`.
+uint64_t piece_table_count(PieceTable *table, const char *needle, uint64_t len, uint64_t from, uint64_t to, uint64_t before, uint64_t *preceding)
+{
+    PieceSearch search;
+    piece_search_init(&search, table, needle, len, from);
+    search.to = to;
+    search.before = before;
+    if (len > 0 && len <= FIND_QUERY_MAX && from < to)
+        piece_node_count(&search, table->root, 0);
+
+    if (preceding)
+        *preceding = search.preceding;
+    return search.count;
+}
+
+// A snapshot is just another reference to the root; edits copy what they touch
+PieceNode *piece_table_snapshot(PieceTable *table)
+{
+    return piece_node_ref(table->root);
+}
+
+void piece_table_restore(PieceTable *table, PieceNode *root)
+{
+    PieceNode *old = table->root;
+    table->root = piece_node_ref(root);
+    piece_node_free(old);
+    piece_node_sum(table->root, &table->len, &table->newlines);
+}
+
+// Rasterizes the glyphs and atlas on the CPU; safe to call off the main thread
+void font_slot_rasterize(FontSlot *slot)
+{
+    if (slot->sdf) {
+        slot->glyphs = LoadFontData(GeistMono_Regular_ttf, GeistMono_Regular_ttf_len, slot->size, NULL, FONT_GLYPHS_NUM, FONT_SDF);
+        slot->atlas = GenImageFontAtlas(slot->glyphs, &slot->recs, FONT_GLYPHS_NUM, slot->size, 0, 1);
+    } else {
+        slot->glyphs = LoadFontData(GeistMono_Regular_ttf, GeistMono_Regular_ttf_len, slot->size, NULL, FONT_GLYPHS_NUM, FONT_DEFAULT);
+        slot->atlas = GenImageFontAtlas(slot->glyphs, &slot->recs, FONT_GLYPHS_NUM, slot->size, FONT_GLYPH_PADDING, 0);
+    }
+
+    slot->status = FONT_SLOT_RASTERIZED;
+}
+
+// Builds the font straight from the atlas baked into fonts/GeistMono-Atlas.h
+Font font_slot_load_baked(FontSlot *slot)
+{
+    GlyphInfo *glyphs = MemAlloc(FONT_GLYPHS_NUM*sizeof(GlyphInfo));
+    Rectangle *recs = MemAlloc(FONT_GLYPHS_NUM*sizeof(Rectangle));
+    for (int i = 0; i < FONT_GLYPHS_NUM; ++i) {
+        int *metrics = GeistMono_Regular_atlas_metrics[i];
+        float *rec = GeistMono_Regular_atlas_recs[i];
+        glyphs[i] = (GlyphInfo){ metrics[0], metrics[1], metrics[2], metrics[3] };
+        recs[i] = (Rectangle){ rec[0], rec[1], rec[2], rec[3] };
+    }
+
+    Image atlas = {
+        .data = GeistMono_Regular_atlas,
+        .width = GeistMono_Regular_atlas_width,
+        .height = GeistMono_Regular_atlas_height,
+        .mipmaps = 1,
+        .format = GeistMono_Regular_atlas_format,
+    };
+
+    return (Font){
+        .baseSize = slot->size,
+        .glyphCount = FONT_GLYPHS_NUM,
+        .glyphPadding = GeistMono_Regular_atlas_padding,
+        .texture = LoadTextureFromImage(atlas),
+        .recs = recs,
+        .glyphs = glyphs,
+    };
+}
+
+void font_slot_prewarm(FontSlot *slot)
+{
+    if (slot->baked)
+        return;
+
+    pthread_mutex_lock(&slot->lock);
+    if (slot->status == FONT_SLOT_EMPTY)
+        font_slot_rasterize(slot);
+    pthread_mutex_unlock(&slot->lock);
+}
+
+// Returns the slot's font, rasterizing it now if the prewarm thread hasn't got
+// to it yet. Only the texture upload has to happen here.
+Font font_slot_get(FontSlot *slot)
+{
+    if (slot->status == FONT_SLOT_LOADED)
+        return slot->font;
+
+    if (slot->baked) {
+        slot->font = font_slot_load_baked(slot);
+        slot->status = FONT_SLOT_LOADED;
+        return slot->font;
+    }
+
+    font_slot_prewarm(slot);
+
+    slot->font = (Font){
+        .baseSize = slot->size,
+        .glyphCount = FONT_GLYPHS_NUM,
+        .glyphPadding = slot->sdf? 0 : FONT_GLYPH_PADDING,
+        .texture = LoadTextureFromImage(slot->atlas),
+        .recs = slot->recs,
+        .glyphs = slot->glyphs,
+    };
+    UnloadImage(slot->atlas);
+
+    // Distance fields are sampled between texels when scaled
+    if (slot->sdf)
+        SetTextureFilter(slot->font.texture, TEXTURE_FILTER_BILINEAR);
+
+    slot->status = FONT_SLOT_LOADED;
+    return slot->font;
+}
+
+void font_slot_free(FontSlot *slot)
+{
+    if (slot->status == FONT_SLOT_LOADED) {
+        UnloadFont(slot->font);
+    } else if (slot->status == FONT_SLOT_RASTERIZED) {
+        UnloadFontData(slot->glyphs, FONT_GLYPHS_NUM);
+        MemFree(slot->recs);
+        UnloadImage(slot->atlas);
+    }
+
+    pthread_mutex_destroy(&slot->lock);
+    slot->status = FONT_SLOT_EMPTY;
+}
+
+void *font_cache_prewarm(void *arg)
+{
+    FontCache *cache = arg;
+    for (int i = 0; i < FONT_SIZES_NUM && !atomic_load(&cache->cancel); ++i)
+        font_slot_prewarm(&cache->slots[i]);
+
+    // The distance field is only needed once the view is zoomed
+    if (!atomic_load(&cache->cancel))
+        font_slot_prewarm(&cache->sdf);
+
+    return NULL;
+}
+
+void font_cache_init(FontCache *cache)
+{
+    for (int i = 0; i < FONT_SIZES_NUM; ++i) {
+        FontSlot *slot = &cache->slots[i];
+        *slot = (FontSlot){ .size = FONT_RESIZE_MIN + i*FONT_RESIZE_FACTOR };
+        slot->baked = slot->size == GeistMono_Regular_atlas_size &&
+                      GeistMono_Regular_atlas_padding == FONT_GLYPH_PADDING &&
+                      GeistMono_Regular_atlas_glyphs == FONT_GLYPHS_NUM;
+        pthread_mutex_init(&slot->lock, NULL);
+    }
+
+    cache->sdf = (FontSlot){ .size = FONT_SDF_SIZE, .sdf = true };
+    pthread_mutex_init(&cache->sdf.lock, NULL);
+
+    cache->prewarming = false;
+    atomic_init(&cache->cancel, false);
+}
+
+// The other sizes are only rasterized once the font is first resized, so
+// sessions that never resize don't pay for them
+void font_cache_start_prewarm(FontCache *cache)
+{
+    if (!cache->prewarming)
+        cache->prewarming = pthread_create(&cache->prewarm, NULL, font_cache_prewarm, cache) == 0;
+}
+
+void font_cache_free(FontCache *cache)
+{
+    // Quitting waits for the slot being rasterized, not for the rest
+    atomic_store(&cache->cancel, true);
+    if (cache->prewarming)
+        pthread_join(cache->prewarm, NULL);
+    cache->prewarming = false;
+
+    for (int i = 0; i < FONT_SIZES_NUM; ++i)
+        font_slot_free(&cache->slots[i]);
+    font_slot_free(&cache->sdf);
+}
+
+Font font_cache_get(FontCache *cache, int size)
+{
+    return font_slot_get(&cache->slots[(size - FONT_RESIZE_MIN)/FONT_RESIZE_FACTOR]);
+}
+
+void state_init(LedState *state, const char *filename)
+{
+    state->filename = filename;
+
+    state->cursor = 0;
+    state->repeat = (KeyRepeat){ 0 };
+
+    state->font_size = FONT_SIZE_INIT;
+    font_cache_init(&state->fonts);
+    state->font = font_cache_get(&state->fonts, state->font_size);
+    state->sdf_shader = LoadShaderFromMemory(NULL, SDF_SHADER_FS);
+    state->theme = themes[0];
+
+    state->save_sync = SAVE_SYNC;
+    const char *sync = getenv("LED_SYNC");
+    if (sync && strcmp(sync, "none") == 0)
+        state->save_sync = SAVE_SYNC_NONE;
+    else if (sync && strcmp(sync, "file") == 0)
+        state->save_sync = SAVE_SYNC_FILE;
+    else if (sync && strcmp(sync, "dir") == 0)
+        state->save_sync = SAVE_SYNC_DIRECTORY;
+
+    state->line = 0;
+    state->line_scroll = 1;
+    state->top_line = 0;
+
+    state->camera.offset = (Vector2){ 0.0f, 0.0f };
+    state->camera.target = (Vector2){ 0.0f, 0.0f };
+    state->camera.rotation = 0.0f;
+    state->camera.zoom = 1.0f;
+
+    undo_journal_init(&state->undo);
+
+    if (FileExists(state->filename)) {
+        load_file(state);
+        undo_journal_open(&state->undo, state->filename);
+    } else
+        piece_table_init(&state->buffer, NULL, 0, false);
+    undo_snapshot(state);
+
+    state->lines_num = state->buffer.newlines;
+}
+
+void load_file(LedState *state)
+{
+    int fd = open(state->filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0)
+            close(fd);
+        piece_table_init(&state->buffer, NULL, 0, false);
+        return;
+    }
+
+    // The file is viewed through a read-only mapping; edited text goes to the add
+    // buffer, so only what is touched ever gets a private copy on the heap
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *text = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text != MAP_FAILED) {
+            // Big files open with the lines of their first megabyte; the rest is
+            // indexed in the background and added as it comes
+            uint64_t len = st.st_size;
+            const char *newline = len > LOAD_FIRST_SIZE? memrchr(text, '\n', LOAD_FIRST_SIZE) : NULL;
+            if (newline)
+                len = newline - text + 1;
+
+            piece_table_init(&state->buffer, text, len, true);
+            TextBuffer *original = &state->buffer.sources[PIECE_SOURCE_ORIGINAL];
+            original->fd = fd;
+            original->capacity = st.st_size;
+            trigram_index_start(&original->trigrams, text, st.st_size);
+            if (len < (uint64_t)st.st_size)
+                file_loader_start(&state->loader, text, len, st.st_size);
+            return;
+        }
+    }
+
+    // Pipes and other unmappable files are read into memory instead
+    uint64_t capacity = ADD_BUFFER_INIT, len = 0;
+    char *text = malloc(capacity);
+    ssize_t n;
+    while ((n = read(fd, text + len, capacity - len)) > 0) {
+        len += n;
+        if (len == capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity);
+        }
+    }
+    close(fd);
+
+    piece_table_init(&state->buffer, text, len, false);
+    trigram_index_start(&state->buffer.sources[PIECE_SOURCE_ORIGINAL].trigrams, text, len);
+}
+
+void file_loader_start(FileLoader *loader, const char *data, uint64_t from, uint64_t len)
+{
+    *loader = (FileLoader){
+        .data = data,
+        .from = from,
+        .len = len,
+    };
+    atomic_init(&loader->cancel, false);
+    atomic_init(&loader->scanned, from);
+    pthread_mutex_init(&loader->lock, NULL);
+
+    loader->running = true;
+    if (pthread_create(&loader->thread, NULL, file_loader_thread, loader) != 0) {
+        file_loader_thread(loader);
+        loader->thread = pthread_self();
+    }
+}
+
+void *file_loader_thread(void *arg)
+{
+    FileLoader *loader = arg;
+    uint64_t from = loader->from;
+    uint64_t scanned = from;
+    uint64_t step = (uint64_t)SCAN_CHUNK_SIZE*get_worker_count();
+    LineStarts lines = { 0 };
+
+    while (scanned < loader->len && !atomic_load(&loader->cancel)) {
+        uint64_t to = scanned + step < loader->len? scanned + step : loader->len;
+        scan_newlines_parallel(loader->data, scanned, to, &lines);
+        scanned = to;
+        atomic_store(&loader->scanned, scanned);
+
+        // Batches end on a line break, so the buffer keeps ending in one while
+        // loading; only the last batch takes whatever is left
+        uint64_t end = scanned == loader->len? scanned : lines.num? lines.offsets[lines.num - 1] : from;
+        if (end == from)
+            continue;
+
+        pthread_mutex_lock(&loader->lock);
+        if (loader->batches_num == loader->batches_capacity) {
+            loader->batches_capacity = loader->batches_capacity? loader->batches_capacity*2 : 16;
+            loader->batches = realloc(loader->batches, loader->batches_capacity*sizeof(LoadBatch));
+        }
+        loader->batches[loader->batches_num++] = (LoadBatch){ end, lines };
+        pthread_mutex_unlock(&loader->lock);
+
+        lines = (LineStarts){ 0 };
+        from = end;
+    }
+    free(lines.offsets);
+
+    pthread_mutex_lock(&loader->lock);
+    loader->finished = true;
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+void file_loader_stop(FileLoader *loader)
+{
+    if (!loader->running)
+        return;
+
+    atomic_store(&loader->cancel, true);
+    if (!pthread_equal(loader->thread, pthread_self()))
+        pthread_join(loader->thread, NULL);
+
+    for (int i = 0; i < loader->batches_num; ++i)
+        free(loader->batches[i].lines.offsets);
+    free(loader->batches);
+    pthread_mutex_destroy(&loader->lock);
+    *loader = (FileLoader){ 0 };
+}
+
+// Called every frame; adds whatever the loader has indexed since the last call
+void load_poll(LedState *state)
+{
+    FileLoader *loader = &state->loader;
+    if (!loader->running)
+        return;
+
+    pthread_mutex_lock(&loader->lock);
+    LoadBatch *batches = loader->batches;
+    int batches_num = loader->batches_num;
+    bool finished = loader->finished;
+    loader->batches = NULL;
+    loader->batches_num = 0;
+    loader->batches_capacity = 0;
+    pthread_mutex_unlock(&loader->lock);
+
+    // Batches end on a newline, which a query never holds, so matches of an
+    // open query in the text read in only add to the total
+    uint64_t loaded = state->buffer.len;
+    for (int i = 0; i < batches_num; ++i) {
+        piece_table_extend(&state->buffer, batches[i].to, &batches[i].lines);
+        free(batches[i].lines.offsets);
+    }
+    free(batches);
+
+    if (finished) {
+        file_loader_stop(loader);
+        // Every line is terminated, so the text always ends in a newline
+        const char *text = state->buffer.sources[PIECE_SOURCE_ORIGINAL].data;
+        uint64_t len = state->buffer.sources[PIECE_SOURCE_ORIGINAL].len;
+        if (text[len - 1] != '\n')
+            piece_table_insert(&state->buffer, state->buffer.len, "\n", 1);
+    }
+
+    FindState *find = &state->find;
+    if (find_counting(state))
+        find->count += piece_table_count(&state->buffer, find->query, find->len, loaded, state->buffer.len, 0, NULL);
+    state->lines_num = state->buffer.newlines;
+}
+
+void state_deinit(LedState *state)
+{
+    // A save still queued on quit is carried out, after the rest of the file
+    // has been read in rather than cancelled
+    if (state->save.queued) {
+        while (state->loader.running)
+            load_poll(state);
+        save_finish(state);
+        write_file(state);
+    }
+
+    file_loader_stop(&state->loader);
+    save_finish(state);
+    search_stop(state);
+    font_cache_free(&state->fonts);
+    UnloadShader(state->sdf_shader);
+    state->font_size = 0;
+
+    piece_table_free(&state->buffer);
+    free(state->line_buffer);
+    state->line_buffer = NULL;
+    state->line_buffer_capacity = 0;
+    state->lines_num = 0;
+    state->line = 0;
+    state->cursor = 0;
+
+    undo_journal_free(&state->undo);
+}
+
+void line_cache_update(LedState *state)
+{
+    if (state->line_cache.valid && state->line_cache.line == state->line)
+        return;
+
+    state->line_cache = (LineCache){
+        .line = state->line,
+        .start = piece_table_line_start(&state->buffer, state->line),
+        .len = piece_table_line_length(&state->buffer, state->line),
+        .valid = true,
+    };
+}
+
+// Keeps the cached line in step with an edit that stays within it
+void line_cache_edit(LedState *state, Edit edit)
+{
+    LineCache *cache = &state->line_cache;
+    if (!cache->valid)
+        return;
+
+    uint64_t end = cache->start + cache->len;
+    if (edit.offset > end)
+        return;
+
+    bool within = edit.offset >= cache->start && edit.offset + edit.deleted_len <= end;
+    if (within && (edit.inserted_len == 0 || !memchr(edit.inserted, '\n', edit.inserted_len))) {
+        cache->len += edit.inserted_len - edit.deleted_len;
+        return;
+    }
+
+    cache->valid = false;
+}
+
+uint64_t get_line_start(LedState *state, int64_t line)
+{
+    if (line != state->line)
+        return piece_table_line_start(&state->buffer, line);
+
+    line_cache_update(state);
+    return state->line_cache.start;
+}
+
+uint64_t get_line_length(LedState *state, int64_t line)
+{
+    if (line != state->line)
+        return piece_table_line_length(&state->buffer, line);
+
+    line_cache_update(state);
+    return state->line_cache.len;
+}
+
+const char *get_line(LedState *state, int64_t line)
+{
+    uint64_t start = get_line_start(state, line);
+    uint64_t len = get_line_length(state, line);
+
+    if (len + 1 > state->line_buffer_capacity) {
+        state->line_buffer_capacity = len + 1 > LINE_BUFFER_INIT? len + 1 : LINE_BUFFER_INIT;
+        state->line_buffer = realloc(state->line_buffer, state->line_buffer_capacity);
+    }
+
+    piece_table_read(&state->buffer, start, len, state->line_buffer);
+    state->line_buffer[len] = '\0';
+    return state->line_buffer;
+}
+
+uint64_t get_cursor_offset(LedState *state)
+{
+    return get_line_start(state, state->line) + state->cursor;
+}
+
+void set_cursor_offset(LedState *state, uint64_t offset)
+{
+    state->line = piece_table_offset_line(&state->buffer, offset);
+    state->cursor = offset - get_line_start(state, state->line);
+}
+
+// Keys that come with a character in the char queue
+bool is_char_key(int key)
+{
+    return (key >= KEY_SPACE && key <= KEY_GRAVE) || (key >= KEY_KP_0 && key <= KEY_KP_EQUAL);
+}
+
+bool is_arrow_key(int key)
+{
+    return key == KEY_LEFT || key == KEY_RIGHT || key == KEY_UP || key == KEY_DOWN;
+}
+
+// Takes a press from the key queue; held, the key repeats from REPEAT_DELAY on
+void key_press(LedState *state, int key)
+{
+    state->repeat.key = key;
+    state->repeat.next = GetTime() + REPEAT_DELAY;
+}
+
+// How many times a held key repeats this frame, at REPEAT_RATE after
+// REPEAT_DELAY, counted in time so slow frames catch up. Presses themselves
+// come from the key queue.
+int key_repeats(LedState *state, int key)
+{
+    KeyRepeat *repeat = &state->repeat;
+    double now = GetTime();
+    if (repeat->key != key || !IsKeyDown(key)) {
+        if (repeat->key == key)
+            repeat->key = 0;
+        return 0;
+    }
+
+    int count = 0;
+    while (repeat->next <= now) {
+        repeat->next += 1.0/REPEAT_RATE;
+        ++count;
+    }
+
+    return count;
+}
+
+void handle_editor_events(LedState *state)
+{
+    if (IsKeyDown(KEY_LEFT_CONTROL)) {
+        if (IsKeyPressed(KEY_Q))
+            state->exit = true;
+        else if (IsKeyPressed(KEY_D))
+            delete_line(state);
+        else if (IsKeyPressed(KEY_S))
+            write_file(state);
+        else if (IsKeyPressed(KEY_Z) && IsKeyDown(KEY_LEFT_SHIFT))
+            undo_travel(state, -UNDO_TIME_STEP);
+        else if (IsKeyPressed(KEY_Y) && IsKeyDown(KEY_LEFT_SHIFT))
+            undo_travel(state, UNDO_TIME_STEP);
+        else if (IsKeyPressed(KEY_Z))
+            undo(state);
+        else if (IsKeyPressed(KEY_Y))
+            redo(state);
+        else if (IsKeyPressed(KEY_F))
+            find_start(state, false);
+        else if (IsKeyPressed(KEY_R))
+            find_start(state, true);
+        else if (IsKeyPressed(KEY_H))
+            replace_start(state);
+        else if (IsKeyPressed(KEY_V))
+            paste(state);
+        else if (IsKeyPressed(KEY_C))
+            copy_line(state);
+        else if (IsKeyPressed(KEY_X))
+            cut_line(state);
+        else if (IsKeyPressed(KEY_K))
+            resize_font(state, RESIZE_ACTION_INCREASE);
+        else if (IsKeyPressed(KEY_J))
+            resize_font(state, RESIZE_ACTION_DECREASE);
+        else if (IsKeyPressed(KEY_EQUAL))
+            state->camera.zoom = 1.0f;
+        else if (IsKeyDown(KEY_T))
+            if (IsKeyPressed(KEY_ONE))
+                state->theme = themes[0];
+            else if (IsKeyPressed(KEY_TWO))
+                state->theme = themes[1];
+
+        float wheel = GetMouseWheelMove();
+        if (wheel != 0.0f)
+            zoom_camera(state, wheel*ZOOM_STEP);
+    }
+
+    if (state->find.active) {
+        handle_find_events(state);
+        if (state->find.active)
+            return;
+    }
+
+    if (state->cursor < 0)
+        state->cursor = 0;
+
+    // Everything queued since the last frame is handled in order. Each key that
+    // types takes its character as it comes, so Enter and Backspace land between
+    // the right ones; characters left over come from key repeat and go at the end.
+    int key, c;
+    while ((key = GetKeyPressed()) != 0) {
+        if (key == KEY_BACKSPACE || is_arrow_key(key))
+            key_press(state, key);
+
+        if (key == KEY_ENTER) {
+            new_line(state);
+        } else if (key == KEY_BACKSPACE) {
+            if (state->cursor > 0)
+                delete_char_cursor(state, true);
+        } else if (key == KEY_TAB) {
+            append_tab(state);
+        } else if (is_arrow_key(key)) {
+            move_cursor(state, key);
+        } else if (is_char_key(key) && !IsKeyDown(KEY_LEFT_CONTROL)) {
+            c = GetCharPressed();
+            if (c >= ' ' && c <= '~')
+                append_char_cursor(state, c, true);
+        }
+    }
+
+    for (int i = key_repeats(state, KEY_BACKSPACE); i > 0 && state->cursor > 0; --i)
+        delete_char_cursor(state, true);
+
+    while ((c = GetCharPressed()) != 0)
+        if (c >= ' ' && c <= '~')
+            append_char_cursor(state, c, true);
+}
+
+void handle_cursor_movement(LedState *state)
+{
+    // Up and down walk the jump list instead
+    if (state->find.active && state->find.regex)
+        return;
+
+    // Presses were taken from the key queue; only repeats are left
+    for (int i = key_repeats(state, KEY_LEFT); i > 0; --i)
+        move_cursor(state, KEY_LEFT);
+    for (int i = key_repeats(state, KEY_RIGHT); i > 0; --i)
+        move_cursor(state, KEY_RIGHT);
+    for (int i = key_repeats(state, KEY_UP); i > 0; --i)
+        move_cursor(state, KEY_UP);
+    for (int i = key_repeats(state, KEY_DOWN); i > 0; --i)
+        move_cursor(state, KEY_DOWN);
+
+    if (IsKeyPressed(KEY_PAGE_DOWN)) {
+        int lines_on_screen = get_number_lines_on_screen(state);
+        state->line_scroll = 1;
+        state->line += lines_on_screen;
+
+        if (state->line >= state->lines_num)
+            state->line = state->lines_num - 1;
+
+        state->cursor = get_line_length(state, state->line);
+        state->top_line = state->line;
+    }
+
+    if (IsKeyPressed(KEY_PAGE_UP)) {
+        int lines_on_screen = get_number_lines_on_screen(state);
+        state->line_scroll = 1;
+        state->line -= lines_on_screen;
+
+        if (state->line < 0)
+            state->line = 0;
+
+        state->cursor = get_line_length(state, state->line);
+        state->top_line = state->line;
+    }
+
+    if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_ZERO))
+        move_to_start(state);
+
+    if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_E))
+        move_to_end(state);
+}
+
+// One step of the cursor for an arrow key
+void move_cursor(LedState *state, int key)
+{
+    if (key == KEY_LEFT) {
+        state->cursor -= state->cursor > 0? 1 : 0;
+    } else if (key == KEY_RIGHT) {
+        state->cursor += state->cursor < get_line_length(state, state->line)? 1 : 0;
+    } else if (key == KEY_UP) {
+        if (state->line > 0) {
+            int64_t line_above_len = get_line_length(state, state->line - 1);
+            --state->line;
+
+            --state->line_scroll;
+            if (state->line_scroll <= 0) {
+                --state->top_line;
+                state->line_scroll = 1;
+            }
+
+            if (state->cursor > line_above_len)
+                state->cursor = line_above_len;
+        } else
+            state->cursor = 0;
+    } else if (key == KEY_DOWN) {
+        if (state->line + 1 < state->lines_num) {
+            int64_t line_below_len = get_line_length(state, state->line + 1);
+            ++state->line;
+            ++state->line_scroll;
+
+            if (state->line_scroll > get_number_lines_on_screen(state)) {
+                ++state->top_line;
+                --state->line_scroll;
+            }
+
+            if (state->cursor > line_below_len)
+                state->cursor = line_below_len;
+        } else
+            state->cursor = get_line_length(state, state->line);
+    }
+}
+
+// A held key repeats on a timer, so frames must keep coming while it is down
+bool is_repeating(LedState *state)
+{
+    return state->repeat.key && IsKeyDown(state->repeat.key);
+}
+
+// Sleeps in EndDrawing until the next input event unless something is in motion,
+// so an idle editor doesn't redraw at FPS
+void update_event_waiting(LedState *state)
+{
+    // A running save, load or search needs frames to report progress and be picked up when done
+    bool wait = !is_repeating(state) && !state->save.running && !state->loader.running && !state->search.running;
+    if (wait == state->waiting_events)
+        return;
+
+    if (wait)
+        EnableEventWaiting();
+    else
+        DisableEventWaiting();
+
+    state->waiting_events = wait;
+}
+
+int get_number_lines_on_screen(LedState *state)
+{
+    int num_lines = GetScreenHeight()/(state->font_size*state->camera.zoom);
+    return num_lines - 1;
+}
+
+void new_line(LedState *state)
+{
+    uint64_t end = get_line_start(state, state->line) + get_line_length(state, state->line);
+    edit_buffer(state, end, 0, "\n", 1, EDIT_RECORD);
+
+    ++state->line;
+    ++state->line_scroll;
+    state->cursor = 0;
+}
+
+// Every change to the buffer goes through here, so it can be recorded for undo
+// and the cached cursor line can be kept in step
+void edit_buffer(LedState *state, uint64_t offset, uint64_t deleted_len, const char *inserted, uint64_t inserted_len, int flags)
+{
+    Edit edit = {
+        .offset = offset,
+        .deleted_len = deleted_len,
+        .inserted = inserted,
+        .inserted_len = inserted_len,
+    };
+
+    char small[64];
+    char *deleted = NULL;
+    if (flags & EDIT_RECORD) {
+        deleted = deleted_len > sizeof(small)? malloc(deleted_len) : small;
+        piece_table_read(&state->buffer, offset, deleted_len, deleted);
+        edit.deleted = deleted;
+        undo_journal_record(&state->undo, edit, flags & EDIT_COALESCE);
+    }
+
+    uint64_t matches = find_count_lines(state, offset, deleted_len);
+    piece_table_delete(&state->buffer, offset, deleted_len);
+    piece_table_insert(&state->buffer, offset, inserted, inserted_len);
+    find_count_edit(state, matches, offset, inserted_len);
+    if (deleted != small)
+        free(deleted);
+
+    line_cache_edit(state, edit);
+    state->lines_num = state->buffer.newlines;
+    state->dirty = true;
+    ++state->edits;
+
+    if (flags & EDIT_RECORD)
+        undo_snapshot(state);
+}
+
+void delete_char_cursor(LedState *state, bool undo)
+{
+    int64_t line_len = get_line_length(state, state->line);
+    if (line_len < 1 || state->cursor < 1)
+        return;
+
+    edit_buffer(state, get_cursor_offset(state) - 1, 1, NULL, 0, undo? EDIT_RECORD | EDIT_COALESCE : 0);
+    --state->cursor;
+}
+
+void append_char_cursor(LedState *state, int c, bool undo)
+{
+    char ch = c;
+    edit_buffer(state, get_cursor_offset(state), 0, &ch, 1, undo? EDIT_RECORD | EDIT_COALESCE : 0);
+    ++state->cursor;
+}
+
+void delete_line(LedState *state)
+{
+    uint64_t start = get_line_start(state, state->line);
+    uint64_t len = get_line_length(state, state->line);
+    if (state->lines_num == 1) {
+        edit_buffer(state, start, len, NULL, 0, EDIT_RECORD);
+    } else {
+        edit_buffer(state, start, len + 1, NULL, 0, EDIT_RECORD);
+        state->line -= state->line > 0? 1 : 0;
+    }
+
+    state->cursor = 0;
+}
+
+void append_tab(LedState *state)
+{
+    edit_buffer(state, get_cursor_offset(state), 0, "    ", 4, EDIT_RECORD | EDIT_COALESCE);
+    state->cursor += 4;
+}
+
+// Inserts text at the cursor as one piece and one undo step, leaving the cursor
+// after it. Line breaks are picked up by the add buffer's newline scan; "\r\n"
+// and lone "\r" are turned into "\n" first.
+void paste_text(LedState *state, const char *text, uint64_t len)
+{
+    char *normalized = NULL;
+    if (memchr(text, '\r', len)) {
+        normalized = malloc(len);
+        uint64_t n = 0;
+        for (uint64_t i = 0; i < len; ++i) {
+            if (text[i] != '\r')
+                normalized[n++] = text[i];
+            else if (i + 1 >= len || text[i + 1] != '\n')
+                normalized[n++] = '\n';
+        }
+        text = normalized;
+        len = n;
+    }
+
+    uint64_t offset = get_cursor_offset(state);
+    edit_buffer(state, offset, 0, text, len, EDIT_RECORD);
+    set_cursor_offset(state, offset + len);
+    free(normalized);
+}
+
+void paste(LedState *state)
+{
+    const char *text = GetClipboardText();
+    if (!text || !text[0])
+        return;
+
+    paste_text(state, text, strlen(text));
+    scroll_to_cursor(state);
+}
+
+// Without a selection, copy and cut work on the whole cursor line
+void copy_line(LedState *state)
+{
+    uint64_t len = get_line_length(state, state->line);
+    char *text = malloc(len + 2);
+    memcpy(text, get_line(state, state->line), len);
+    text[len] = '\n';
+    text[len + 1] = '\0';
+    SetClipboardText(text);
+    free(text);
+}
+
+void cut_line(LedState *state)
+{
+    copy_line(state);
+    delete_line(state);
+    scroll_to_cursor(state);
+}
+
+// Scrolls so the cursor line is on screen, bringing it to the top if it was off
+void scroll_to_cursor(LedState *state)
+{
+    int64_t top = state->top_line;
+    if (state->line >= top && state->line < top + get_number_lines_on_screen(state)) {
+        state->line_scroll = state->line - top + 1;
+        return;
+    }
+
+    state->line_scroll = 1;
+    state->top_line = state->line;
+}
+
+// Ctrl+F opens a literal query and Ctrl+R a regex one; the same key closes it
+// again, leaving the cursor on the match, and the other switches over
+void find_start(LedState *state, bool regex)
+{
+    FindState *find = &state->find;
+    if (find->active && find->regex == regex) {
+        find_close(state);
+        return;
+    }
+
+    if (!find->active) {
+        find->len = 0;
+        find->origin = get_cursor_offset(state);
+        find->replacing = false;
+    }
+    find->active = true;
+    find->regex = regex;
+    find->match = FIND_NONE;
+    search_stop(state);
+    find_update(state, find->origin);
+}
+
+void find_close(LedState *state)
+{
+    state->find.active = false;
+    search_stop(state);
+}
+
+// Moves to the first match at or after `from`, wrapping around to the top.
+// A regex query starts a new search instead, dropping the one in flight.
+void find_update(LedState *state, uint64_t from)
+{
+    FindState *find = &state->find;
+    if (find->regex) {
+        search_start(state);
+        return;
+    }
+
+    find_seek(state, from);
+    find_recount(state);
+}
+
+// Moves to the first literal match at or after `from`, wrapping around to the top
+void find_seek(LedState *state, uint64_t from)
+{
+    FindState *find = &state->find;
+    uint64_t match = piece_table_find(&state->buffer, find->query, find->len, from);
+    if (match == FIND_NONE && from > 0)
+        match = piece_table_find(&state->buffer, find->query, find->len, 0);
+
+    find->match = match;
+    if (match != FIND_NONE) {
+        set_cursor_offset(state, match);
+        scroll_to_cursor(state);
+    }
+}
+
+// Enter: on to the next match, which is one further along, or the first after
+// wrapping around; after an edit, counts where it is from the top
+void find_next(LedState *state)
+{
+    FindState *find = &state->find;
+    uint64_t previous = find->match;
+    find_seek(state, previous != FIND_NONE? previous + 1 : get_cursor_offset(state));
+
+    if (find->match == FIND_NONE)
+        find->index = 0;
+    else if (previous != FIND_NONE && find->index > 0)
+        find->index = find->match > previous? find->index + 1 : 1;
+    else {
+        piece_table_count(&state->buffer, find->query, find->len, 0, state->buffer.len, find->match, &find->index);
+        ++find->index;
+    }
+}
+
+// Counts the matches of a new query, and the ones before the match it found
+void find_recount(LedState *state)
+{
+    FindState *find = &state->find;
+    uint64_t preceding = 0;
+    find->count = piece_table_count(&state->buffer, find->query, find->len, 0, state->buffer.len, find->match, &preceding);
+    find->index = find->match != FIND_NONE? preceding + 1 : 0;
+}
+
+// Whether the total is kept for a literal query that is open
+bool find_counting(LedState *state)
+{
+    FindState *find = &state->find;
+    return find->active && !find->regex && find->len > 0;
+}
+
+// Matches of the literal query on the lines that [offset, offset + len] touches.
+// Edits count these lines before and after, so the total never needs a rescan.
+uint64_t find_count_lines(LedState *state, uint64_t offset, uint64_t len)
+{
+    FindState *find = &state->find;
+    if (!find_counting(state))
+        return 0;
+
+    uint64_t first = piece_table_offset_line(&state->buffer, offset);
+    uint64_t last = piece_table_offset_line(&state->buffer, offset + len);
+    uint64_t from = piece_table_line_start(&state->buffer, first);
+    uint64_t to = piece_table_line_start(&state->buffer, last + 1);
+
+    return piece_table_count(&state->buffer, find->query, find->len, from, to, 0, NULL);
+}
+
+// Takes in an edit that left `len` bytes at offset where `before` matches were
+void find_count_edit(LedState *state, uint64_t before, uint64_t offset, uint64_t len)
+{
+    FindState *find = &state->find;
+    if (!find->active || find->regex || find->len == 0)
+        return;
+
+    find->count += find_count_lines(state, offset, len) - before;
+    // The text moved under the match; Enter finds its place again
+    find->match = FIND_NONE;
+    find->index = 0;
+}
+
+void find_append(LedState *state, int c)
+{
+    FindState *find = &state->find;
+    if (c < ' ' || c > '~')
+        return;
+
+    if (find->replacing) {
+        if (find->replacement_len < FIND_QUERY_MAX)
+            find->replacement[find->replacement_len++] = c;
+        return;
+    }
+
+    if (find->len >= FIND_QUERY_MAX)
+        return;
 
-void write_file(LedState *state)
+    find->query[find->len++] = c;
+    find_update(state, find->origin);
+}
+
+// Erases the last character of the query, or of the replacement being typed
+void find_backspace(LedState *state)
+{
+    FindState *find = &state->find;
+    if (find->replacing) {
+        find->replacement_len -= find->replacement_len > 0? 1 : 0;
+    } else if (find->len > 0) {
+        --find->len;
+        find_update(state, find->origin);
+    }
+}
+
+// While finding, typing goes to the query; Enter goes to the next match and
+// Escape closes the query, leaving the keys queued after it to the editor
+void handle_find_events(LedState *state)
 {
-    state->dirty = false;
-    FILE *f = fopen(state->filename, "w");
-    for (int i = 0; i < state->lines_num; ++i)
-        fprintf(f, "%s\n", state->lines[i]);
+    FindState *find = &state->find;
+    int key;
+    while ((key = GetKeyPressed()) != 0) {
+        if (key == KEY_BACKSPACE || is_arrow_key(key))
+            key_press(state, key);
 
-    fclose(f);
+        if (key == KEY_ESCAPE) {
+            find_close(state);
+            return;
+        }
+
+        if (key == KEY_ENTER && find->replacing)
+            find_replace(state);
+        else if (key == KEY_ENTER && find->regex)
+            search_jump(state, state->search.selected + 1);
+        else if (key == KEY_ENTER && find->count > 0)
+            find_next(state);
+        else if (key == KEY_BACKSPACE)
+            find_backspace(state);
+        else if (key == KEY_DOWN && find->regex)
+            search_jump(state, state->search.selected + 1);
+        else if (key == KEY_UP && find->regex)
+            search_jump(state, (state->search.selected < 0? 0 : state->search.selected) - 1);
+        else if (is_arrow_key(key) && !find->regex)
+            move_cursor(state, key);
+        else if (is_char_key(key) && !IsKeyDown(KEY_LEFT_CONTROL))
+            find_append(state, GetCharPressed());
+    }
+
+    int c;
+    while ((c = GetCharPressed()) != 0)
+        find_append(state, c);
+
+    for (int i = key_repeats(state, KEY_BACKSPACE); i > 0; --i)
+        find_backspace(state);
+
+    if (find->regex) {
+        for (int i = key_repeats(state, KEY_DOWN); i > 0; --i)
+            search_jump(state, state->search.selected + 1);
+        for (int i = key_repeats(state, KEY_UP); i > 0; --i)
+            search_jump(state, (state->search.selected < 0? 0 : state->search.selected) - 1);
+    }
 }
 
-void undo(LedState *state)
+// Ctrl+H opens a literal query with an empty replacement, or switches typing
+// between the query and the replacement
+void replace_start(LedState *state)
 {
-    if (!state->undo)
+    FindState *find = &state->find;
+    if (find->active && !find->regex) {
+        find->replacing = !find->replacing;
         return;
+    }
+
+    find_start(state, false);
+    find->replacing = true;
+    find->replacement_len = 0;
+}
 
-    UndoAction action = state->undo->action;
-    state->line = action.line;
-    state->cursor = action.cursor - 1;
+// Builds the edits for the lines starting in one chunk. A query has no line
+// breaks, so no match crosses into another chunk's lines.
+void replace_chunk(void *arg, int index)
+{
+    ReplaceJob *job = arg;
+    ReplaceChunk *chunk = &job->chunks[index];
+    uint64_t from = (uint64_t)index*SEARCH_CHUNK_SIZE;
+    uint64_t to = from + SEARCH_CHUNK_SIZE < job->table->len? from + SEARCH_CHUNK_SIZE : job->table->len;
+    uint64_t start, begin, end;
+    chunk->text = piece_table_read_lines(job->table, from, to, &start, &begin, &end);
+    const char *text = chunk->text;
 
-    switch (action.type) {
-        case UNDO_ACTION_DELETE_CHAR:
-            append_char_cursor(state, action.ch, false);
+    uint64_t at = begin;
+    while (at < end) {
+        uint64_t match = find_bytes(text + at, end - at, job->needle, job->needle_len);
+        if (match == FIND_NONE)
             break;
-        case UNDO_ACTION_APPEND_CHAR:
-            delete_char_cursor(state, false);
+
+        // The line is rebuilt from its first match to the end of its last
+        uint64_t first = at + match, last = first;
+        const char *newline = memchr(text + first, '\n', end - first);
+        uint64_t line_end = newline? (uint64_t)(newline - text) : end;
+        uint64_t inserted_len = 0;
+        for (match = first; match != FIND_NONE; ) {
+            op_log_push(&chunk->inserted, text + last, match - last);
+            op_log_push(&chunk->inserted, job->replacement, job->replacement_len);
+            inserted_len += match - last + job->replacement_len;
+            last = match + job->needle_len;
+            ++chunk->matches;
+
+            uint64_t next = find_bytes(text + last, line_end - last, job->needle, job->needle_len);
+            match = next == FIND_NONE? FIND_NONE : last + next;
+        }
+
+        if (chunk->edits_num == chunk->edits_capacity) {
+            chunk->edits_capacity = chunk->edits_capacity? chunk->edits_capacity*2 : 64;
+            chunk->edits = realloc(chunk->edits, chunk->edits_capacity*sizeof(Edit));
+        }
+        chunk->edits[chunk->edits_num++] = (Edit){
+            .offset = start + first,
+            .deleted = text + first,
+            .deleted_len = last - first,
+            .inserted_len = inserted_len,
+        };
+        at = line_end + 1;
+    }
+
+    // Edits point into the text, so only a chunk without any can let go of it
+    if (chunk->edits_num == 0) {
+        free(chunk->text);
+        chunk->text = NULL;
+    }
+
+    // The replacement text is only placed once the log has stopped growing
+    const char *inserted = (const char *)chunk->inserted.data;
+    for (uint64_t i = 0; i < chunk->edits_num; ++i) {
+        chunk->edits[i].inserted = inserted;
+        inserted += chunk->edits[i].inserted_len;
+    }
+}
+
+// Replaces every match of needle, found in parallel by chunks of lines, as one
+// undo step and one change to the buffer. Returns the number of matches.
+uint64_t replace_all(LedState *state, const char *needle, uint64_t needle_len, const char *replacement, uint64_t replacement_len)
+{
+    if (needle_len == 0)
+        return 0;
+
+    int chunks_num = (state->buffer.len + SEARCH_CHUNK_SIZE - 1)/SEARCH_CHUNK_SIZE;
+    ReplaceJob job = {
+        .table = &state->buffer,
+        .needle = needle,
+        .needle_len = needle_len,
+        .replacement = replacement,
+        .replacement_len = replacement_len,
+        .chunks = calloc(chunks_num, sizeof(ReplaceChunk)),
+    };
+    parallel_for(chunks_num, replace_chunk, &job);
+
+    uint64_t count = 0, matches = 0;
+    for (int i = 0; i < chunks_num; ++i) {
+        count += job.chunks[i].edits_num;
+        matches += job.chunks[i].matches;
+    }
+
+    // Back to front, so no edit moves the text the ones after it apply to
+    Edit *edits = malloc(count*sizeof(Edit));
+    uint64_t n = 0;
+    for (int i = chunks_num; i > 0; --i)
+        for (uint64_t j = job.chunks[i - 1].edits_num; j > 0; --j)
+            edits[n++] = job.chunks[i - 1].edits[j - 1];
+
+    if (count > 0) {
+        undo_journal_seal(&state->undo);
+        undo_journal_add(&state->undo, edits, count);
+        for (uint64_t i = 0; i < count; ++i) {
+            piece_table_delete(&state->buffer, edits[i].offset, edits[i].deleted_len);
+            piece_table_insert(&state->buffer, edits[i].offset, edits[i].inserted, edits[i].inserted_len);
+        }
+
+        state->lines_num = state->buffer.newlines;
+        state->line_cache.valid = false;
+        state->dirty = true;
+        ++state->edits;
+        undo_snapshot(state);
+    }
+
+    for (int i = 0; i < chunks_num; ++i) {
+        free(job.chunks[i].text);
+        free(job.chunks[i].edits);
+        op_log_free(&job.chunks[i].inserted);
+    }
+    free(job.chunks);
+    free(edits);
+    return matches;
+}
+
+// Enter while replacing: replaces every match of the query and closes it
+void find_replace(LedState *state)
+{
+    FindState *find = &state->find;
+    // The tail of a file still loading is not in the tree to be replaced in
+    if (state->loader.running) {
+        snprintf(state->status, sizeof(state->status), "replace: file still loading");
+        find_close(state);
+        return;
+    }
+
+    uint64_t offset = get_cursor_offset(state);
+    uint64_t matches = replace_all(state, find->query, find->len, find->replacement, find->replacement_len);
+    snprintf(state->status, sizeof(state->status), "replaced %" PRIu64, matches);
+    find_close(state);
+
+    set_cursor_offset(state, offset < state->buffer.len? offset : state->buffer.len - 1);
+    scroll_to_cursor(state);
+}
+
+// Starts searching the buffer for the regex query on a snapshot of the tree.
+// A query that doesn't compile leaves its error to show instead.
+void search_start(LedState *state)
+{
+    FindState *find = &state->find;
+    SearchJob *job = &state->search;
+    search_stop(state);
+    if (find->len == 0)
+        return;
+
+    char pattern[FIND_QUERY_MAX + 1];
+    memcpy(pattern, find->query, find->len);
+    pattern[find->len] = '\0';
+
+    regex_t regex;
+    int error = regcomp(&regex, pattern, SEARCH_REGEX_FLAGS);
+    if (error) {
+        regerror(error, &regex, job->error, sizeof(job->error));
+        return;
+    }
+    regfree(&regex);
+
+    memcpy(job->pattern, pattern, sizeof(pattern));
+    job->table = (PieceTable){
+        .root = piece_table_snapshot(&state->buffer),
+        .len = state->buffer.len,
+        .newlines = state->buffer.newlines,
+    };
+    for (int i = 0; i < 2; ++i) {
+        job->table.sources[i].data = state->buffer.sources[i].data;
+        text_buffer_pin(&state->buffer.sources[i]);
+    }
+    job->len = state->buffer.len;
+    job->edits = state->edits;
+    job->selected = -1;
+    atomic_init(&job->cancel, false);
+    atomic_init(&job->done, false);
+    atomic_init(&job->searched, 0);
+    pthread_mutex_init(&job->lock, NULL);
+
+    job->running = true;
+    if (pthread_create(&job->thread, NULL, search_thread, job) != 0) {
+        search_thread(job);
+        job->thread = pthread_self();
+    }
+}
+
+void *search_thread(void *arg)
+{
+    SearchJob *job = arg;
+    int chunks = (job->table.len + SEARCH_CHUNK_SIZE - 1)/SEARCH_CHUNK_SIZE;
+    parallel_for(chunks, search_chunk, job);
+
+    atomic_store(&job->done, true);
+    return NULL;
+}
+
+// Searches the lines starting in one chunk. Each call compiles its own copy of
+// the regex, as glibc locks a shared one.
+void search_chunk(void *arg, int index)
+{
+    SearchJob *job = arg;
+    if (atomic_load(&job->cancel))
+        return;
+
+    uint64_t from = (uint64_t)index*SEARCH_CHUNK_SIZE;
+    uint64_t to = from + SEARCH_CHUNK_SIZE < job->table.len? from + SEARCH_CHUNK_SIZE : job->table.len;
+    uint64_t start, begin, end;
+    char *text = piece_table_read_lines(&job->table, from, to, &start, &begin, &end);
+
+    regex_t regex;
+    if (begin >= end || regcomp(&regex, job->pattern, SEARCH_REGEX_FLAGS) != 0) {
+        atomic_fetch_add(&job->searched, to - from);
+        free(text);
+        return;
+    }
+
+    SearchMatch *found = NULL;
+    int found_num = 0, found_capacity = 0;
+    regmatch_t match;
+    uint64_t at = begin;
+    while (at < end && !atomic_load(&job->cancel)) {
+        match.rm_so = at;
+        match.rm_eo = end;
+        if (regexec(&regex, text, 1, &match, REG_STARTEND) != 0)
             break;
+
+        // An empty match would match again right where it is; look past it, as a
+        // longer match can still start further along the line
+        if (match.rm_eo == match.rm_so) {
+            at = match.rm_so + 1;
+            continue;
+        }
+
+        if (found_num == found_capacity) {
+            found_capacity = found_capacity? found_capacity*2 : 64;
+            found = realloc(found, found_capacity*sizeof(SearchMatch));
+        }
+        found[found_num++] = (SearchMatch){ start + match.rm_so, match.rm_eo - match.rm_so, 0 };
+        at = match.rm_eo;
+    }
+    regfree(&regex);
+    free(text);
+
+    // Once there are more matches than anyone will look through, the rest are dropped
+    pthread_mutex_lock(&job->lock);
+    if (job->found_total + found_num > SEARCH_MATCH_MAX) {
+        found_num = SEARCH_MATCH_MAX - job->found_total;
+        job->truncated = true;
+        atomic_store(&job->cancel, true);
+    }
+    if (job->found_num + found_num > job->found_capacity) {
+        job->found_capacity = job->found_num + found_num > 2*job->found_capacity? job->found_num + found_num : 2*job->found_capacity;
+        job->found = realloc(job->found, job->found_capacity*sizeof(SearchMatch));
+    }
+    if (found_num > 0)
+        memcpy(job->found + job->found_num, found, found_num*sizeof(SearchMatch));
+    job->found_num += found_num;
+    job->found_total += found_num;
+    pthread_mutex_unlock(&job->lock);
+    free(found);
+
+    atomic_fetch_add(&job->searched, to - from);
+}
+
+int search_match_compare(const void *a, const void *b)
+{
+    const SearchMatch *x = a, *y = b;
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Called every frame; takes in the matches found since the last call, and
+// searches again when the buffer has changed under the results
+void search_poll(LedState *state)
+{
+    FindState *find = &state->find;
+    SearchJob *job = &state->search;
+    bool stale = job->edits != state->edits || (!job->running && job->len != state->buffer.len);
+    if (find->active && find->regex && job->pattern[0] && stale) {
+        search_start(state);
+        return;
+    }
+
+    if (!job->running)
+        return;
+
+    // Read first, so nothing handed over after the matches are taken is missed
+    bool done = atomic_load(&job->done);
+    pthread_mutex_lock(&job->lock);
+    int found_num = job->found_num;
+    int from = job->matches_num;
+    if (job->matches_num + found_num > job->matches_capacity) {
+        job->matches_capacity = job->matches_num + found_num;
+        job->matches = realloc(job->matches, job->matches_capacity*sizeof(SearchMatch));
+    }
+    if (found_num > 0)
+        memcpy(job->matches + job->matches_num, job->found, found_num*sizeof(SearchMatch));
+    job->matches_num += found_num;
+    job->found_num = 0;
+    pthread_mutex_unlock(&job->lock);
+
+    for (int i = from; i < job->matches_num; ++i)
+        job->matches[i].line = piece_table_offset_line(&state->buffer, job->matches[i].offset);
+    if (found_num > 0)
+        search_merge(job, from);
+
+    if (done)
+        search_finish(job, &state->buffer);
+}
+
+// Waits for the search thread and lets go of the snapshot; the matches stay
+// Sorts the matches from `from` on and merges them into the sorted ones before.
+// Chunks are taken in order, so the new matches mostly go at the end already.
+void search_merge(SearchJob *job, int from)
+{
+    SearchMatch *matches = job->matches;
+    qsort(matches + from, job->matches_num - from, sizeof(SearchMatch), search_match_compare);
+    if (from == 0 || matches[from - 1].offset < matches[from].offset)
+        return;
+
+    // Only the old matches past the first new one have to move
+    int lo = 0, hi = from;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        if (matches[mid].offset < matches[from].offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int moved = from - lo;
+    SearchMatch *old = malloc(moved*sizeof(SearchMatch));
+    memcpy(old, matches + lo, moved*sizeof(SearchMatch));
+    int i = 0, j = from, k = lo;
+    while (i < moved && j < job->matches_num)
+        matches[k++] = old[i].offset < matches[j].offset? old[i++] : matches[j++];
+    while (i < moved)
+        matches[k++] = old[i++];
+    free(old);
+}
+
+void search_finish(SearchJob *job, PieceTable *buffer)
+{
+    if (!job->running)
+        return;
+
+    if (!pthread_equal(job->thread, pthread_self()))
+        pthread_join(job->thread, NULL);
+    job->running = false;
+
+    piece_node_free(job->table.root);
+    job->table = (PieceTable){ 0 };
+    for (int i = 0; i < 2; ++i)
+        text_buffer_unpin(&buffer->sources[i]);
+
+    free(job->found);
+    job->found = NULL;
+    job->found_num = 0;
+    job->found_capacity = 0;
+    pthread_mutex_destroy(&job->lock);
+}
+
+// Cancels the search in flight, if any, and drops its matches
+void search_stop(LedState *state)
+{
+    SearchJob *job = &state->search;
+    atomic_store(&job->cancel, true);
+    search_finish(job, &state->buffer);
+
+    free(job->matches);
+    *job = (SearchJob){ 0 };
+}
+
+// Selects a match from the jump list, wrapping around at either end, and moves there
+void search_jump(LedState *state, int index)
+{
+    SearchJob *job = &state->search;
+    if (job->matches_num == 0)
+        return;
+
+    job->selected = (index%job->matches_num + job->matches_num)%job->matches_num;
+    set_cursor_offset(state, job->matches[job->selected].offset);
+    scroll_to_cursor(state);
+}
+
+// Starts writing the buffer out in the background. Edits can carry on meanwhile;
+// a save asked for while one runs is started as soon as it is done.
+void write_file(LedState *state)
+{
+    // The file can't be replaced while it is still being read in
+    SaveJob *job = &state->save;
+    if (job->running || state->loader.running) {
+        job->queued = true;
+        return;
+    }
+
+    // The buffer may still be reading from a mapping of the file, so truncating it
+    // in place would pull the text out from under us. Write a sibling file instead
+    // and rename it over the original; the mapping keeps the old inode alive.
+    if (!realpath(state->filename, job->target))
+        snprintf(job->target, sizeof(job->target), "%s", state->filename);
+    job->fd = -1;
+    errno = ENAMETOOLONG;
+    if (snprintf(job->path, sizeof(job->path), "%s.XXXXXX", job->target) < (int)sizeof(job->path))
+        job->fd = mkstemp(job->path);
+    if (job->fd < 0) {
+        snprintf(state->status, sizeof(state->status), "save failed: %s", strerror(errno));
+        return;
+    }
+
+    // mkstemp creates the file 0600 and ours; keep the original's mode, and its
+    // owner where we may, or what fopen would give
+    struct stat st;
+    if (stat(job->target, &st) == 0) {
+        if (fchown(job->fd, st.st_uid, st.st_gid) < 0)
+            fchown(job->fd, -1, st.st_gid);
+        fchmod(job->fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(job->fd, 0666 & ~mask);
+    }
+
+    // The writer gets its own reference to the tree and to the source blocks as
+    // they are now; edits from here on copy nodes and blocks instead of changing them
+    undo_journal_seal(&state->undo);
+    state->undo.saving = state->undo.current;
+    job->root = piece_table_snapshot(&state->buffer);
+    job->len = state->buffer.len;
+    for (int i = 0; i < 2; ++i) {
+        job->sources[i] = state->buffer.sources[i].data;
+        text_buffer_pin(&state->buffer.sources[i]);
+    }
+    job->splice_fd = state->buffer.sources[PIECE_SOURCE_ORIGINAL].fd;
+    atomic_store(&job->written, 0);
+    atomic_store(&job->done, false);
+    job->sync = state->save_sync;
+    job->edits = state->edits;
+    job->running = true;
+    job->queued = false;
+
+    if (pthread_create(&job->thread, NULL, save_thread, job) != 0) {
+        save_thread(job);
+        job->thread = pthread_self();
+    }
+}
+
+void *save_thread(void *arg)
+{
+    SaveJob *job = arg;
+
+    // The original is only replaced once the new text is complete, and on disk if asked
+    PieceWriter writer = {
+        .fd = job->fd,
+        .sources = { job->sources[0], job->sources[1] },
+        .splice_fd = job->splice_fd,
+        .written = &job->written,
+    };
+    piece_node_write(&writer, job->root);
+    piece_writer_flush(&writer);
+
+    bool written = !writer.failed && (job->sync == SAVE_SYNC_NONE || fsync(job->fd) == 0);
+    job->error = written? 0 : errno;
+    if (close(job->fd) < 0 && written) {
+        written = false;
+        job->error = errno;
+    }
+    if (written && rename(job->path, job->target) < 0) {
+        written = false;
+        job->error = errno;
+    }
+    if (!written)
+        unlink(job->path);
+
+    // The rename itself only survives a crash once the directory entry is flushed
+    job->synced = !written || job->sync != SAVE_SYNC_DIRECTORY || sync_directory(job->target);
+    if (!job->synced)
+        job->error = errno;
+
+    atomic_store(&job->done, true);
+    return NULL;
+}
+
+// Called every frame; wraps up a finished save and starts a queued one
+void save_poll(LedState *state)
+{
+    SaveJob *job = &state->save;
+    if (job->running && atomic_load(&job->done))
+        save_finish(state);
+
+    if (!job->running && job->queued && !state->loader.running)
+        write_file(state);
+}
+
+// Waits for the running save, if any, and takes in its result
+void save_finish(LedState *state)
+{
+    SaveJob *job = &state->save;
+    if (!job->running)
+        return;
+
+    if (!pthread_equal(job->thread, pthread_self()))
+        pthread_join(job->thread, NULL);
+    job->running = false;
+
+    piece_node_free(job->root);
+    job->root = NULL;
+    for (int i = 0; i < 2; ++i)
+        text_buffer_unpin(&state->buffer.sources[i]);
+
+    int64_t target = state->undo.saving;
+    state->undo.saving = -1;
+    if (job->error && job->synced) {
+        snprintf(state->status, sizeof(state->status), "save failed: %s", strerror(job->error));
+        return;
+    }
+
+    if (!job->synced)
+        snprintf(state->status, sizeof(state->status), "saved, directory sync failed: %s", strerror(job->error));
+    else
+        state->status[0] = '\0';
+
+    undo_journal_persist(&state->undo, state->filename, target, state->save_sync != SAVE_SYNC_NONE);
+
+    // Anything typed while the save ran is not in the file
+    if (state->edits == job->edits)
+        state->dirty = false;
+}
+
+bool sync_directory(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    char dir[PATH_MAX];
+    if (slash == filename)
+        snprintf(dir, sizeof(dir), "/");
+    else if (slash)
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename), filename);
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+// Replays a record forwards, or reverts it, and returns where the cursor should go
+uint64_t apply_record(LedState *state, const unsigned char *record, bool forward)
+{
+    uint64_t count;
+    Edit *edits = op_log_read_record(record, &count);
+    uint64_t cursor = 0;
+
+    if (forward) {
+        for (uint64_t i = 0; i < count; ++i) {
+            Edit *edit = &edits[i];
+            uint64_t matches = find_count_lines(state, edit->offset, edit->deleted_len);
+            piece_table_delete(&state->buffer, edit->offset, edit->deleted_len);
+            piece_table_insert(&state->buffer, edit->offset, edit->inserted, edit->inserted_len);
+            find_count_edit(state, matches, edit->offset, edit->inserted_len);
+            cursor = edit->offset + edit->inserted_len;
+        }
+    } else {
+        for (uint64_t i = count; i > 0; --i) {
+            Edit *edit = &edits[i - 1];
+            uint64_t matches = find_count_lines(state, edit->offset, edit->inserted_len);
+            piece_table_delete(&state->buffer, edit->offset, edit->inserted_len);
+            piece_table_insert(&state->buffer, edit->offset, edit->deleted, edit->deleted_len);
+            find_count_edit(state, matches, edit->offset, edit->deleted_len);
+            cursor = edit->offset + edit->deleted_len;
+        }
+    }
+    free(edits);
+
+    state->lines_num = state->buffer.newlines;
+    state->line_cache.valid = false;
+    state->dirty = true;
+    ++state->edits;
+    return cursor;
+}
+
+// Keeps the current piece tree on the current node if it has gone long enough without
+void undo_snapshot(LedState *state)
+{
+    UndoJournal *journal = &state->undo;
+    UndoNode *node = &journal->nodes[journal->current];
+    // While a file loads, its tail is not in the tree yet, so a snapshot would lose it
+    if (journal->open || node->snapshot || node->since < UNDO_SNAPSHOT_INTERVAL || state->loader.running)
+        return;
+
+    node->snapshot = piece_table_snapshot(&state->buffer);
+    node->since = 0;
+}
+
+// Brings the buffer to the state of any node: up to the common ancestor and back
+// down, or, for long walks, from a snapshot close above the target
+void undo_goto(LedState *state, int64_t target)
+{
+    UndoJournal *journal = &state->undo;
+    undo_journal_seal(journal);
+
+    UndoNode *nodes = journal->nodes;
+    int64_t current = journal->current;
+    if (target == current)
+        return;
+
+    int64_t common = undo_journal_common(journal, current, target);
+    int64_t walk = nodes[current].depth + nodes[target].depth - 2*nodes[common].depth;
+    int64_t snapshot = undo_journal_snapshot_near(journal, target);
+    uint64_t cursor = get_cursor_offset(state);
+    int64_t from = common;
+
+    if (snapshot >= 0 && walk > UNDO_SNAPSHOT_INTERVAL && nodes[target].depth - nodes[snapshot].depth < walk) {
+        piece_table_restore(&state->buffer, nodes[snapshot].snapshot);
+        state->lines_num = state->buffer.newlines;
+        state->line_cache.valid = false;
+        state->dirty = true;
+        ++state->edits;
+        journal->current = from = snapshot;
+        // The restore skips the edit hooks, so the total is counted afresh
+        if (find_counting(state)) {
+            state->find.match = FIND_NONE;
+            find_recount(state);
+        }
+    } else {
+        for (int64_t node = current; node != common; node = nodes[node].parent) {
+            cursor = apply_record(state, journal->records.data + nodes[node].record, false);
+            journal->current = nodes[node].parent;
+            undo_snapshot(state);
+        }
+    }
+
+    int64_t len = nodes[target].depth - nodes[from].depth;
+    int64_t *path = malloc(len*sizeof(int64_t));
+    for (int64_t i = len, node = target; i > 0; node = nodes[node].parent)
+        path[--i] = node;
+
+    for (int64_t i = 0; i < len; ++i) {
+        UndoNode *node = &nodes[path[i]];
+        cursor = apply_record(state, journal->records.data + node->record, true);
+        nodes[node->parent].child = path[i];
+        journal->current = path[i];
+        undo_snapshot(state);
+    }
+    free(path);
+
+    if (cursor >= state->buffer.len)
+        cursor = state->buffer.len - 1;
+    set_cursor_offset(state, cursor);
+}
+
+// Steps to the parent state; past the root, the history saved with the file is
+// brought into the tree first
+void undo(LedState *state)
+{
+    UndoJournal *journal = &state->undo;
+    undo_journal_seal(journal);
+    // Saved history can reach anywhere in the file, which may not all be loaded yet
+    if (journal->nodes[journal->current].parent < 0 && !state->loader.running)
+        undo_journal_adopt(journal, state->buffer.len);
+
+    int64_t parent = journal->nodes[journal->current].parent;
+    if (parent >= 0)
+        undo_goto(state, parent);
+}
+
+void redo(LedState *state)
+{
+    UndoJournal *journal = &state->undo;
+    undo_journal_seal(journal);
+
+    int64_t child = journal->nodes[journal->current].child;
+    if (child >= 0)
+        undo_goto(state, child);
+}
+
+// Goes to the newest state that existed `seconds` from the current one's time,
+// across branches
+void undo_travel(LedState *state, double seconds)
+{
+    UndoJournal *journal = &state->undo;
+    undo_journal_seal(journal);
+
+    // Nodes are stored in the order they were made, so their times are sorted
+    double time = journal->nodes[journal->current].time + seconds;
+    int64_t lo = 0, hi = journal->nodes_num;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo)/2;
+        if (journal->nodes[mid].time <= time)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    state->undo = undo_delete(state->undo);
+    undo_goto(state, lo > 0? lo - 1 : 0);
 }
 
 void resize_font(LedState *state, int action)
 {
+    font_cache_start_prewarm(&state->fonts);
+
     int sign = (action == RESIZE_ACTION_INCREASE)? 1 : -1;
     int resize_factor = sign*FONT_RESIZE_FACTOR;
     state->font_size += resize_factor;
@@ -515,8 +4366,25 @@ void resize_font(LedState *state, int action)
         return;
     }
 
-    UnloadFont(state->font);
-    state->font = LoadFontFromMemory(".ttf", GeistMono_Regular_ttf, GeistMono_Regular_ttf_len, state->font_size, NULL, 95);
+    state->font = font_cache_get(&state->fonts, state->font_size);
+}
+
+// Zoom is a plain camera scale; the text switches to the SDF atlas while it's active
+void zoom_camera(LedState *state, float amount)
+{
+    state->camera.zoom += amount;
+    if (state->camera.zoom < ZOOM_MIN)
+        state->camera.zoom = ZOOM_MIN;
+    if (state->camera.zoom > ZOOM_MAX)
+        state->camera.zoom = ZOOM_MAX;
+
+    // Wheel steps don't sum back to exactly 1, which would keep the SDF path on
+    if (fabsf(state->camera.zoom - 1.0f) < 0.001f)
+        state->camera.zoom = 1.0f;
+
+    // The SDF atlas is made from the TTF, so it is only loaded on the first zoom
+    if (state->camera.zoom != 1.0f && state->fonts.sdf.status != FONT_SLOT_LOADED)
+        state->sdf_font = font_slot_get(&state->fonts.sdf);
 }
 
 void move_to_start(LedState *state)
@@ -526,28 +4394,155 @@ void move_to_start(LedState *state)
 
 void move_to_end(LedState *state)
 {
-    int line_len = strlen(state->lines[state->line]);
-    state->cursor = line_len;
+    state->cursor = get_line_length(state, state->line);
+}
+
+// Where a line is drawn, relative to the top line
+int line_y(LedState *state, int64_t line)
+{
+    return (line - state->top_line)*state->font_size;
 }
 
 void draw_text(LedState *state, const char *text, int x, int y, Color color)
 {
+    if (state->sdf_active) {
+        BeginShaderMode(state->sdf_shader);
+        DrawTextEx(state->sdf_font, text, (Vector2){x, y}, (float)state->font_size, 1.0f, color);
+        EndShaderMode();
+        return;
+    }
+
     DrawTextEx(state->font, text, (Vector2){x, y}, (float)state->font_size, 1.0f, color);
 }
 
-void draw_cursor(LedState *state)
+// Width of a column in the font the text is drawn with right now. The distance
+// field atlas has its own size and is scaled, so its advance differs.
+float column_advance(LedState *state)
 {
-    char ch = state->lines[state->line][state->cursor - 1];
-    GlyphInfo glyph = GetGlyphInfo(state->font, ch);
+    Font font = state->sdf_active? state->sdf_font : state->font;
+    return GetGlyphInfo(font, ' ').advanceX*(float)state->font_size/font.baseSize + 1.0f;
+}
 
-    Rectangle cursor_rec = { state->cursor*(glyph.advanceX + 1), state->line*state->font_size, glyph.advanceX, state->font_size };
+void draw_cursor(LedState *state)
+{
+    float advance = column_advance(state);
+    Rectangle cursor_rec = { state->cursor*advance, line_y(state, state->line), advance - 1.0f, state->font_size };
     DrawRectangleRec(cursor_rec, Fade(state->theme.text_color, 0.5f));
 }
 
+// Marks the matches on the lines in [first_line, last_line) only: literal ones by
+// searching each line, regex ones by looking their lines up in the jump list
+void draw_matches(LedState *state, int64_t first_line, int64_t last_line)
+{
+    FindState *find = &state->find;
+    if (!find->active || find->len == 0)
+        return;
+
+    float advance = column_advance(state);
+    Color color = Fade(state->theme.text_color, 0.2f);
+    Color current = Fade(state->theme.text_color, 0.4f);
+
+    if (find->regex) {
+        SearchJob *job = &state->search;
+        int lo = 0, hi = job->matches_num;
+        while (lo < hi) {
+            int mid = lo + (hi - lo)/2;
+            if (job->matches[mid].line < first_line)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for (int i = lo; i < job->matches_num && job->matches[i].line < last_line; ++i) {
+            SearchMatch *match = &job->matches[i];
+            uint64_t column = match->offset - get_line_start(state, match->line);
+            Rectangle rec = { column*advance, line_y(state, match->line), match->len*advance, state->font_size };
+            DrawRectangleRec(rec, i == job->selected? current : color);
+        }
+        return;
+    }
+
+    for (int64_t line = first_line; line < last_line; ++line) {
+        uint64_t start = get_line_start(state, line);
+        uint64_t len = get_line_length(state, line);
+        const char *text = get_line(state, line);
+        for (uint64_t at = 0; at < len; ++at) {
+            uint64_t match = find_bytes(text + at, len - at, find->query, find->len);
+            if (match == FIND_NONE)
+                break;
+
+            at += match;
+            Rectangle rec = { at*advance, line_y(state, line), find->len*advance, state->font_size };
+            DrawRectangleRec(rec, start + at == find->match? current : color);
+        }
+    }
+}
+
+// The matches of a regex query, a few around the selected one, above the HUD
+void draw_jump_list(LedState *state)
+{
+    SearchJob *job = &state->search;
+    if (!state->find.active || !state->find.regex || job->matches_num == 0)
+        return;
+
+    int shown = job->matches_num < SEARCH_LIST_LINES? job->matches_num : SEARCH_LIST_LINES;
+    int first = job->selected - shown/2;
+    if (first > job->matches_num - shown)
+        first = job->matches_num - shown;
+    if (first < 0)
+        first = 0;
+
+    int y = GetScreenHeight() - (shown + 1)*state->font_size;
+    DrawRectangle(0, y, GetScreenWidth(), shown*state->font_size, state->theme.background_color);
+    for (int i = first; i < first + shown; ++i, y += state->font_size) {
+        SearchMatch *match = &job->matches[i];
+        if (i == job->selected)
+            DrawRectangle(0, y, GetScreenWidth(), state->font_size, state->theme.hud_color);
+
+        char preview[SEARCH_PREVIEW_MAX + 1];
+        uint64_t start = piece_table_line_start(&state->buffer, match->line);
+        uint64_t len = piece_table_line_length(&state->buffer, match->line);
+        len = piece_table_read(&state->buffer, start, len < SEARCH_PREVIEW_MAX? len : SEARCH_PREVIEW_MAX, preview);
+        preview[len] = '\0';
+        draw_text(state, TextFormat("%" PRId64 ": %s", match->line + 1, preview), 0, y, state->theme.text_color);
+    }
+}
+
 void draw_hud(LedState *state)
 {
     DrawRectangle(0, GetScreenHeight() - state->font_size, GetScreenWidth(), state->font_size, state->theme.hud_color);
-    const char *line_information = TextFormat("%d:%d", state->line + 1, state->cursor + 1);
+    const char *line_information = TextFormat("%" PRId64 ":%" PRId64, state->line + 1, state->cursor + 1);
     const char *text = TextFormat((state->dirty? "%s [*] | %s" : "%s | %s"), state->filename, line_information);
+    if (state->find.active && state->find.regex) {
+        FindState *find = &state->find;
+        SearchJob *job = &state->search;
+        text = TextFormat("%s | regex: %.*s", text, find->len, find->query);
+        if (job->error[0])
+            text = TextFormat("%s (%s)", text, job->error);
+        else if (job->running)
+            text = TextFormat("%s (%d, %d%%)", text, job->matches_num, (int)(atomic_load(&job->searched)*100/(job->len? job->len : 1)));
+        else if (find->len)
+            text = TextFormat("%s (%d%s matches)", text, job->matches_num, job->truncated? "+" : "");
+    } else if (state->find.active) {
+        FindState *find = &state->find;
+        text = TextFormat("%s | find: %.*s", text, find->len, find->query);
+        if (find->replacing)
+            text = TextFormat("%s -> %.*s", text, find->replacement_len, find->replacement);
+        if (find->len && find->count == 0)
+            text = TextFormat("%s (not found)", text);
+        else if (find->len && find->index > 0)
+            text = TextFormat("%s (match %" PRIu64 "/%" PRIu64 ")", text, find->index, find->count);
+        else if (find->len)
+            text = TextFormat("%s (%" PRIu64 " matches)", text, find->count);
+    } else if (state->loader.running) {
+        uint64_t scanned = atomic_load(&state->loader.scanned);
+        text = TextFormat("%s | loading %d%%", text, (int)(scanned*100/state->loader.len));
+    } else if (state->save.running) {
+        uint64_t written = atomic_load(&state->save.written);
+        int percent = state->save.len? written*100/state->save.len : 100;
+        text = TextFormat("%s | saving %d%%", text, percent);
+    } else if (state->status[0]) {
+        text = TextFormat("%s | %s", text, state->status);
+    }
     draw_text(state, text, 0, GetScreenHeight() - state->font_size, state->theme.text_color);
 }